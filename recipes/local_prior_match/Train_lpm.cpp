@@ -8,6 +8,9 @@
 
 #include <cmath>
 #include <cstdlib>
+#include <future>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -20,6 +23,7 @@
 #include "criterion/criterion.h"
 #include "data/Featurize.h"
 #include "libraries/common/Dictionary.h"
+#include "libraries/lm/KenLM.h"
 #include "module/module.h"
 #include "recipes/models/local_prior_match/src/module/LMWrapper.h"
 #include "recipes/models/local_prior_match/src/runtime/runtime.h"
@@ -63,8 +67,9 @@ int main(int argc, char** argv) {
         FLAGS_world_size,
         FLAGS_max_devices_per_node,
         FLAGS_rndv_filepath);
-    reducer = std::make_shared<fl::CoalescingReducer>(
-        1.0 / fl::getWorldSize(), true, true);
+    // averaging over workers is folded into the gradient scaling after
+    // backward, see scaleAndClipGradNorm
+    reducer = std::make_shared<fl::CoalescingReducer>(1.0, true, true);
   }
 
   int worldRank = fl::getWorldRank();
@@ -88,11 +93,6 @@ int main(int argc, char** argv) {
   DictionaryMap dicts;
   dicts.insert({kTargetIdx, amDict});
 
-  // Note: fairseq vocab should start with:
-  // <fairseq_style> - 0 <pad> - 1, kEosToken - 2, kUnkToken - 3
-  Dictionary lmDict(FLAGS_lmdict);
-  lmDict.setDefaultIndex(lmDict.getIndex(kUnkToken));
-
   auto lexicon = loadWords(FLAGS_lexicon, FLAGS_maxword);
 
   /* =========== Create Network & Optimizers / Reload Snapshot ============ */
@@ -116,11 +116,25 @@ int main(int argc, char** argv) {
   }
 
   // create LM
-  std::shared_ptr<fl::Module> lmNetwork;
-  W2lSerializer::load(FLAGS_lm, lmNetwork);
-  auto dictIndexMap = genTokenDictIndexMap(amDict, lmDict);
-  auto lm = std::make_shared<LMWrapper>(
-      lmNetwork, dictIndexMap, lmDict.getIndex(kEosToken));
+  std::shared_ptr<LMWrapper> lm;
+  if (FLAGS_lpmlmtype == kNeuralLM) {
+    // Note: fairseq vocab should start with:
+    // <fairseq_style> - 0 <pad> - 1, kEosToken - 2, kUnkToken - 3
+    Dictionary lmDict(FLAGS_lmdict);
+    lmDict.setDefaultIndex(lmDict.getIndex(kUnkToken));
+
+    std::shared_ptr<fl::Module> lmNetwork;
+    W2lSerializer::load(FLAGS_lm, lmNetwork);
+    auto dictIndexMap = genTokenDictIndexMap(amDict, lmDict);
+    lm = std::make_shared<LMWrapper>(
+        lmNetwork, dictIndexMap, lmDict.getIndex(kEosToken));
+    lm->setPrefixSharing(FLAGS_lmprefixshare);
+  } else if (FLAGS_lpmlmtype == kNgramLM) {
+    auto ngram = std::make_shared<KenLM>(FLAGS_lm, amDict);
+    lm = std::make_shared<LMWrapper>(ngram, amDict.getIndex(kEosToken));
+  } else {
+    LOG(FATAL) << "Unsupported lpmlmtype: " << FLAGS_lpmlmtype;
+  }
 
   LOG_MASTER(INFO) << "[Network] " << network->prettyString();
   LOG_MASTER(INFO) << "[Network Params: " << numTotalParams(network) << "]";
@@ -141,24 +155,53 @@ int main(int argc, char** argv) {
 
   /* =========== Load Proposal Network ============ */
   LOG(INFO) << "Load proposal model from " << propPath;
-  std::unordered_map<std::string, std::string> propcfg; // unused
+  std::unordered_map<std::string, std::string> propcfg;
   std::shared_ptr<fl::Module> propnet;
   std::shared_ptr<SequenceCriterion> base_propcrit;
   std::shared_ptr<Seq2SeqCriterion> propcrit;
 
   W2lSerializer::load(propPath, propcfg, propnet, base_propcrit);
   propcrit = std::dynamic_pointer_cast<Seq2SeqCriterion>(base_propcrit);
+  // number of proposal updates in this run, persisted through prop.bin
+  int64_t propVersion = propcfg.find(kPropVersion) == propcfg.end()
+      ? 0
+      : std::stoll(propcfg[kPropVersion]);
+  propcfg[kPropVersion] = std::to_string(propVersion);
+  // prop.bin holds a half-precision network when running with --fp16prop
+  convertParams(propnet, f32);
 
   /* ===================== Create Dataset ===================== */
   auto pairedDs = createDataset(
       FLAGS_train, dicts, lexicon, FLAGS_batchsize, worldRank, worldSize);
-  auto unpairedAudioDs = createDataset(
-      FLAGS_trainaudio,
-      dicts,
-      lexicon,
-      FLAGS_unpairedBatchsize,
-      worldRank,
-      worldSize);
+  // W2lDataset reads its ordering and binning from the global flags, so
+  // override them while creating the unpaired set. Its targets are the
+  // reference lengths from decode_len_lpm, so e.g. output_spiral buckets
+  // utterances by duration and then by reference length.
+  auto unpairedAudioDs = [&]() {
+    auto dataorder = FLAGS_dataorder;
+    auto inputbinsize = FLAGS_inputbinsize;
+    auto outputbinsize = FLAGS_outputbinsize;
+    if (!FLAGS_unpaireddataorder.empty()) {
+      FLAGS_dataorder = FLAGS_unpaireddataorder;
+    }
+    if (FLAGS_unpairedinputbinsize >= 0) {
+      FLAGS_inputbinsize = FLAGS_unpairedinputbinsize;
+    }
+    if (FLAGS_unpairedoutputbinsize >= 0) {
+      FLAGS_outputbinsize = FLAGS_unpairedoutputbinsize;
+    }
+    auto ds = createDataset(
+        FLAGS_trainaudio,
+        dicts,
+        lexicon,
+        FLAGS_unpairedBatchsize,
+        worldRank,
+        worldSize);
+    FLAGS_dataorder = dataorder;
+    FLAGS_inputbinsize = inputbinsize;
+    FLAGS_outputbinsize = outputbinsize;
+    return ds;
+  }();
 
   if (FLAGS_noresample) {
     LOG_MASTER(INFO) << "Shuffling trainset";
@@ -181,14 +224,29 @@ int main(int argc, char** argv) {
   }
 
   /* ===================== Training Dataset Scheduler ===================== */
+  // the lazy permutation reads the training sets out of order, which only
+  // the scheduler prefetch hides
+  LOG_IF(
+      FATAL,
+      FLAGS_lazyshuffle && !FLAGS_noresample && FLAGS_schedulerprefetch <= 0)
+      << "--lazyshuffle requires --schedulerprefetch > 0";
   DataScheduler trainDscheduler(
       {pairedDs, unpairedAudioDs},
       {kParallelData, kUnpairedAudio},
       {FLAGS_pairediter, FLAGS_audioiter},
-      startEpoch + 1);
+      startEpoch + 1,
+      FLAGS_schedulerprefetch,
+      FLAGS_schedulerthreads,
+      FLAGS_nthread > 0);
+  if (!config[kSchedulerState].empty()) {
+    trainDscheduler.setState(
+        DataScheduler::deserializeState(config[kSchedulerState]));
+  }
 
   int64_t nItersPerEpoch = FLAGS_pairediter + FLAGS_audioiter;
 
+  std::unique_ptr<ProposalProducer> propProducer;
+
   /* ===================== Meters ===================== */
   SSLTrainMeters meters;
   for (const auto& s : validds) {
@@ -199,10 +257,36 @@ int main(int argc, char** argv) {
   bool logOnEpoch = FLAGS_reportiters == 0;
   LogHelper logHelper(runIdx, runPath, isMaster, logOnEpoch);
   logHelper.saveConfig(config);
-  logHelper.writeHeader(meters);
+
+  // fields reported in every line of the perf log
+  std::unordered_map<std::string, double> perfFields;
+  if (FLAGS_fp16prop) {
+    perfFields[kPropFp16Speedup] = 0.0;
+  }
+  if (FLAGS_fp16lm) {
+    perfFields[kLMFp16Speedup] = 0.0;
+  }
+  ScheduleTuner scheduleTuner(FLAGS_schedepochsec, FLAGS_schedaudioratio);
+  // flags as parsed, the tuned schedule is appended to them
+  auto savedGflags = config[kGflags];
+  if (scheduleTuner.enabled()) {
+    perfFields[kSchedPairedIter] = FLAGS_pairediter;
+    perfFields[kSchedAudioIter] = FLAGS_audioiter;
+    perfFields[kPairedStepSec] = 0.0;
+    perfFields[kAudioStepSec] = 0.0;
+  }
+  logHelper.writeHeader(meters, perfFields);
+
+  auto trainParams = network->params();
+  auto critParams = criterion->params();
+  trainParams.insert(trainParams.end(), critParams.begin(), critParams.end());
 
   /* ===================== Hooks ===================== */
-  if (reducer) {
+  // with LPM micro-batching the criterion gradients are accumulated over
+  // several backward passes, so they are only handed to the reducer once the
+  // step's backward is complete
+  bool reduceAfterBackward = FLAGS_lpmtokenbudget > 0;
+  if (reducer && !reduceAfterBackward) {
     fl::distributeModuleGrads(network, reducer);
     fl::distributeModuleGrads(criterion, reducer);
   }
@@ -210,10 +294,50 @@ int main(int argc, char** argv) {
   fl::allReduceParameters(network);
   fl::allReduceParameters(criterion);
 
+  /* ===================== Hypothesis cache ===================== */
+  std::unique_ptr<HypothesisCache> hypCache;
+  auto hypCacheKey = [](int64_t version) {
+    return format(
+        "prop%ld_beam%ld_len%ld_lb%.3f_ub%.3f",
+        version,
+        FLAGS_lpmBeamsz,
+        FLAGS_maxdecoderoutputlen,
+        FLAGS_hyplenratiolb,
+        FLAGS_hyplenratioub);
+  };
+  if (FLAGS_hypcache) {
+    // the producer generates the hypotheses of every batch itself
+    if (FLAGS_propqueuesize > 0) {
+      LOG(FATAL) << "--hypcache is not supported with --propqueuesize > 0";
+    }
+    // all ranks share the directory, it is created by the master only and
+    // the others wait for it (the all-reduce acts as a barrier)
+    auto hypCacheDir = pathsConcat(runPath, "hypcache");
+    if (isMaster) {
+      dirCreate(hypCacheDir);
+    }
+    if (worldSize > 1) {
+      auto barrier = af::constant(0, 1);
+      fl::allReduce(barrier);
+      af::sync();
+    }
+    hypCache.reset(new HypothesisCache(hypCacheDir, worldRank));
+    hypCache->setKey(hypCacheKey(propVersion));
+  }
+
   /* ===================== Training starts ===================== */
   int64_t curEpoch = startEpoch;
   int64_t curIter = startIter;
+  // a checkpoint saved mid-epoch resumes within that epoch
+  int64_t startEpochIter = std::stoll(config[kStartEpochIter]);
+  if (startEpochIter > 0 && startEpochIter < nItersPerEpoch) {
+    --curEpoch;
+  } else {
+    startEpochIter = 0;
+  }
+  DataScheduler::State schedulerState;
   bool isPairedData;
+  int64_t globalBatchIdx;
   network->train();
   criterion->train();
   lm->eval();
@@ -226,41 +350,143 @@ int main(int argc, char** argv) {
   double properr = avgValidErr(meters);
   LOG_MASTER(INFO) << "Initial ProposalNetwork Err = " << properr;
 
+  /* ===================== Precision ===================== */
+  // the inference-only proposal network and LM may run in half precision,
+  // the speedup measured on one training batch is reported in the perf log
+  if (FLAGS_fp16prop) {
+    auto probe = unpairedAudioDs->get(0)[kInputIdx];
+    auto runProp = [&]() { proposalForward(propnet, probe); };
+    double fp32Time = timeIt(runProp);
+    convertParams(propnet, f16);
+    double fp16Time = timeIt(runProp);
+    perfFields[kPropFp16Speedup] = fp32Time / fp16Time;
+    LOG_MASTER(INFO) << "ProposalNetwork fp16 speedup = "
+                     << perfFields[kPropFp16Speedup];
+  }
+  if (FLAGS_fp16lm) {
+    auto probe = fl::noGrad(pairedDs->get(0)[kTargetIdx]);
+    auto probeLen = fl::noGrad(getTargetLength(
+        probe.array(), dicts[kTargetIdx].getIndex(kEosToken)));
+    auto runLM = [&]() { lm->forward({probe, probeLen}); };
+    double fp32Time = timeIt(runLM);
+    convertParams(lm, f16);
+    double fp16Time = timeIt(runLM);
+    perfFields[kLMFp16Speedup] = fp32Time / fp16Time;
+    LOG_MASTER(INFO) << "LM fp16 speedup = " << perfFields[kLMFp16Speedup];
+  }
+
+  if (FLAGS_propqueuesize > 0) {
+    propProducer.reset(new ProposalProducer(
+        &trainDscheduler,
+        propnet,
+        propcrit,
+        dicts[kTargetIdx].getIndex(kEosToken),
+        FLAGS_propqueuesize));
+  }
+
   resetTrainMeters(meters);
 
+  // host buffer for the hypothesis targets and indices of the unpaired step
+  PinnedStagingBuffer staging;
+
+  // in low-sync mode the NaN checks and meter updates stay on the device and
+  // are only read back every FLAGS_lowsynciters iterations
+  bool lowSync = FLAGS_lowsynciters > 0;
+  DeferredStats deferredStats;
+  auto checkNaN = [&](const af::array& arr, const std::string& msg) {
+    if (lowSync) {
+      deferredStats.checkNaN(arr, msg);
+    } else if (af::anyTrue<bool>(af::isNaN(arr))) {
+      LOG(FATAL) << msg;
+    }
+  };
+  auto addValue = [&](fl::AverageValueMeter& meter, const af::array& val) {
+    if (lowSync) {
+      deferredStats.add(meter, val);
+    } else {
+      meter.add(val);
+    }
+  };
+
+  // the per-phase timers (and the syncs they need) are only sampled every
+  // FLAGS_timersampleiters iterations
+  bool timeIter = true;
+  auto isTimedIter = [](int64_t iter) {
+    return FLAGS_timersampleiters <= 1 || iter % FLAGS_timersampleiters == 0;
+  };
+  auto resumeTimer = [&](const std::string& name) {
+    if (timeIter) {
+      meters.timer[name].resume();
+    }
+  };
+  auto stopTimer = [&](const std::string& name) {
+    if (timeIter) {
+      meters.timer[name].stopAndIncUnit();
+    }
+  };
+
   while (curEpoch < FLAGS_iter) {
     double lrScale = std::pow(FLAGS_gamma, curEpoch / FLAGS_stepsize);
     netoptim->setLr(lrScale * FLAGS_lr);
 
     ++curEpoch;
     af::sync();
-    meters.timer[kSampleTimer].resume();
+    if (isTimedIter(curIter + 1)) {
+      meters.timer[kSampleTimer].resume();
+      scheduleTuner.startStep();
+    }
     meters.timer[kRuntime].resume();
     meters.timer[kTimer].resume();
     LOG_MASTER(INFO) << "Epoch " << curEpoch << " started!";
     LOG_MASTER(INFO) << "  Learning rate = " << netoptim->getLr();
 
-    int scheduleIter = 0;
+    int scheduleIter = startEpochIter;
+    startEpochIter = 0;
     while (scheduleIter < nItersPerEpoch) {
-      auto sample = trainDscheduler.get();
-      isPairedData = af::allTrue<bool>(sample[kDataTypeIdx] == kParallelData);
+      std::vector<af::array> sample;
+      HypothesisBatch hypos;
+      bool hasHypos = false;
+      if (propProducer) {
+        auto propBatch = propProducer->get();
+        sample = std::move(propBatch.sample);
+        isPairedData = propBatch.dataType == kParallelData;
+        globalBatchIdx = propBatch.globalBatchIdx;
+        hypos = std::move(propBatch.hypos);
+        hasHypos = propBatch.propVersion >= 0 &&
+            propProducer->version() - propBatch.propVersion <=
+                FLAGS_propmaxstale;
+        schedulerState = std::move(propBatch.schedulerState);
+      } else {
+        sample = trainDscheduler.get();
+        isPairedData = trainDscheduler.getDataType() == kParallelData;
+        globalBatchIdx = trainDscheduler.getGlobalBatchIdx();
+      }
       ++curIter;
       ++scheduleIter;
-      af::sync();
+      timeIter = isTimedIter(curIter);
+      if (timeIter) {
+        af::sync();
+      }
       int bs = isPairedData ? FLAGS_batchsize : FLAGS_unpairedBatchsize;
 
       meters.timer[kTimer].incUnit();
-      meters.timer[kSampleTimer].stopAndIncUnit();
-      meters.stats.add(sample[kInputIdx], sample[kTargetIdx]);
-      if (af::anyTrue<bool>(af::isNaN(sample[kInputIdx])) ||
-          af::anyTrue<bool>(af::isNaN(sample[kTargetIdx]))) {
-        LOG(FATAL) << "Sample has NaN values";
+      if (timeIter) {
+        meters.timer[kSampleTimer].stopAndIncUnit();
       }
+      meters.stats.add(sample[kInputIdx], sample[kTargetIdx]);
+      checkNaN(sample[kInputIdx], "Sample has NaN values");
+      checkNaN(sample[kTargetIdx], "Sample has NaN values");
+
+      netoptim->zeroGrad();
+      // set when the forward already ran the backward pass
+      bool hasGrads = false;
 
       // forward
-      meters.timer[kFwdTimer].resume();
+      resumeTimer(kFwdTimer);
       auto output = network->forward({fl::input(sample[kInputIdx])}).front();
-      af::sync();
+      if (timeIter) {
+        af::sync();
+      }
 
       fl::Variable loss;
       fl::Variable lment;
@@ -268,31 +494,69 @@ int main(int argc, char** argv) {
       auto tgtLen = getTargetLength(
           targets.array(), dicts[kTargetIdx].getIndex(kEosToken));
       if (isPairedData) {
-        meters.timer[kCritFwdTimer].resume();
+        resumeTimer(kCritFwdTimer);
         loss = criterion->forward({output, targets}).front();
 
-        if (af::anyTrue<bool>(af::isNaN(loss.array()))) {
-          LOG(FATAL) << "ASR loss has NaN values";
-        }
-        meters.train.values[kASRLoss].add(loss.array());
-        meters.timer[kCritFwdTimer].stopAndIncUnit();
+        checkNaN(loss.array(), "ASR loss has NaN values");
+        addValue(meters.train.values[kASRLoss], loss.array());
+        stopTimer(kCritFwdTimer);
       } else {
-        fl::Variable lmLogprob;
-        meters.timer[kBeamTimer].resume();
-        std::vector<std::vector<int>> paths;
-        std::vector<int> hypoNums;
-        auto propoutput =
-            propnet->forward({fl::input(sample[kInputIdx])}).front();
-        std::tie(paths, hypoNums) = batchBeamSearch(
-            propoutput, propcrit, dicts[kTargetIdx].getIndex(kEosToken));
-        meters.timer[kBeamTimer].stopAndIncUnit();
+        fl::Variable lmLogprob, lmRenormProb;
+        resumeTimer(kBeamTimer);
+        std::vector<std::string> sampleIds;
+        bool cachedHypos = false;
+        if (hypCache && !hasHypos) {
+          sampleIds = readSampleIds(sample[kSampleIdx]);
+          cachedHypos = hypCache->get(sampleIds, hypos);
+        }
+        if (!hasHypos && !cachedHypos) {
+          // the producer's worker may be running the proposal model
+          std::unique_lock<std::mutex> propLock;
+          if (propProducer) {
+            propLock = propProducer->lockProposalModel();
+          }
+          auto propoutput = proposalForward(propnet, sample[kInputIdx]);
+          hypos = batchBeamSearch(
+              propoutput, propcrit, dicts[kTargetIdx].getIndex(kEosToken));
+        }
+        stopTimer(kBeamTimer);
 
         auto refLen = afToVector<int>(tgtLen);
-        std::tie(paths, hypoNums) = filterBeamByLength(paths, hypoNums, refLen);
-        auto hypoNumsArr =
-            af::array(af::dim4(hypoNums.size()), hypoNums.data());
-        af::array remIdx = af::sort(af::where(hypoNumsArr));
-        int remBs = remIdx.dims()[0];
+        filterBeamByLength(hypos, refLen);
+        if (hypCache && !hasHypos && !cachedHypos) {
+          hypCache->put(sampleIds, hypos);
+        }
+        // utterances left with hypotheses; the indices are uploaded together
+        // with the targets of the step
+        std::vector<int> remIdxVec, hypoNums;
+        for (int i = 0; i < hypos.hypoNums.size(); i++) {
+          if (hypos.hypoNums[i] > 0) {
+            remIdxVec.push_back(i);
+            hypoNums.push_back(hypos.hypoNums[i]);
+          }
+        }
+        int remBs = remIdxVec.size();
+        staging.reset();
+        auto remIdxSlot = staging.stage(remIdxVec);
+        double padWaste = 0.0;
+
+        // with --lpmbalancelm the ranks share the LM scoring of their
+        // hypotheses evenly. This is collective, so it runs before the
+        // per-rank branches, also on ranks without hypotheses.
+        af::array balancedScores;
+        if (FLAGS_lpmbalancelm) {
+          double imbalance, lmImbalance;
+          resumeTimer(kLMFwdTimer);
+          balancedScores = balancedLMForward(
+              lm,
+              hypos,
+              dicts[kTargetIdx].getIndex(kEosToken),
+              imbalance,
+              lmImbalance);
+          stopTimer(kLMFwdTimer);
+          meters.values[kHypImbalance].add(imbalance);
+          meters.values[kLMImbalance].add(lmImbalance);
+        }
 
         if (remBs == 0) {
           LOG(INFO) << "WARNING : using a made-up loss because of empty batch";
@@ -302,49 +566,180 @@ int main(int argc, char** argv) {
           loss = criterion->forward({output, fl::noGrad(sample[kTargetIdx])})
                      .front();
           loss = 0.0 * loss;
+        } else if (FLAGS_lpmtokenbudget > 0) {
+          // LM scoring and the LPM loss run over micro-batches of at most
+          // FLAGS_lpmtokenbudget target tokens. Their gradients are
+          // accumulated into a leaf copy of the encoder output, which is
+          // backpropagated through the network once. The step is redone with
+          // half the budget if the device runs out of memory. The criterion
+          // also scores the eos padding, so every micro-batch is padded to
+          // the longest hypothesis of the step, like the unsplit step.
+          int eos = dicts[kTargetIdx].getIndex(kEosToken);
+          int maxHypLen = 0;
+          for (int i = 0; i < hypos.size(); i++) {
+            maxHypLen = std::max(maxHypLen, hypos.length(i));
+          }
+          auto remIdx = PinnedStagingBuffer::get(staging.upload(), remIdxSlot);
+          auto remOutput = output(af::span, af::span, remIdx);
+          std::vector<int> hypoUttIdx;
+          for (int i = 0; i < hypoNums.size(); i++) {
+            hypoUttIdx.insert(hypoUttIdx.end(), hypoNums[i], i);
+          }
+
+          int64_t tokenBudget = FLAGS_lpmtokenbudget;
+          fl::Variable encGrad;
+          while (true) {
+            try {
+              auto ranges = splitByTokenBudget(hypos, tokenBudget);
+              // stage the targets of all micro-batches, upload them at once
+              staging.reset();
+              std::vector<PinnedStagingBuffer::Slot> chunkSlots;
+              for (const auto& r : ranges) {
+                chunkSlots.push_back(
+                    stageTarget(hypos, r, eos, staging, maxHypLen));
+              }
+              auto staged = staging.upload();
+              std::vector<fl::Variable> chunkTargets, chunkLmScores, chunkLens;
+              // with --lpmbalancelm lm-fwd was already timed above
+              if (!FLAGS_lpmbalancelm) {
+                resumeTimer(kLMFwdTimer);
+              }
+              for (const auto& slot : chunkSlots) {
+                auto chunkTgt =
+                    fl::noGrad(PinnedStagingBuffer::get(staged, slot));
+                auto chunkLen = getTargetLength(chunkTgt.array(), eos);
+                if (!FLAGS_lpmbalancelm) {
+                  auto chunkLmScore =
+                      lm->forward({chunkTgt, fl::noGrad(chunkLen)}).front();
+                  chunkLmScores.push_back(fl::noGrad(chunkLmScore.array()));
+                }
+                chunkTargets.push_back(chunkTgt);
+                chunkLens.push_back(fl::noGrad(chunkLen));
+              }
+              lmLogprob = fl::negate(
+                  FLAGS_lpmbalancelm ? fl::noGrad(balancedScores)
+                                     : fl::concatenate(chunkLmScores, 0));
+              if (!FLAGS_lpmbalancelm) {
+                stopTimer(kLMFwdTimer);
+              }
+
+              resumeTimer(kBeamFwdTimer);
+              lmRenormProb = adjustProb(lmLogprob, hypoNums, true, true);
+              auto encOutput = fl::Variable(remOutput.array(), true);
+              std::vector<fl::Variable> chunkLosses;
+              for (int c = 0; c < ranges.size(); c++) {
+                std::vector<int> chunkHypoNums(hypoNums.size(), 0);
+                for (int h = ranges[c].first; h < ranges[c].second; h++) {
+                  ++chunkHypoNums[hypoUttIdx[h]];
+                }
+                auto chunkOutput = batchEncoderOutput(chunkHypoNums, encOutput);
+                auto chunkLoss =
+                    criterion->forward({chunkOutput, chunkTargets[c]}).front();
+                auto chunkProb = lmRenormProb(
+                    af::seq(ranges[c].first, ranges[c].second - 1));
+                chunkLoss = FLAGS_lmweight * chunkProb * chunkLoss;
+                chunkLoss.backward();
+                chunkLosses.push_back(fl::noGrad(chunkLoss.array()));
+              }
+              encGrad = encOutput.grad();
+              loss = fl::concatenate(chunkLosses, 0);
+              tgtLen = fl::concatenate(chunkLens, 1).array();
+              padWaste = paddingWaste(hypos, {{0, hypos.size()}});
+              break;
+            } catch (const af::exception& ex) {
+              if (ex.err() != AF_ERR_NO_MEM || tokenBudget <= 1) {
+                throw;
+              }
+              tokenBudget /= 2;
+              LOG(WARNING) << "Out of memory in the LPM step, retrying with "
+                           << "a token budget of " << tokenBudget;
+              netoptim->zeroGrad();
+              af::deviceGC();
+            }
+          }
+          // encGrad covers the kept utterances only, the index op scatters it
+          remOutput.backward(encGrad);
+          hasGrads = true;
+          stopTimer(kBeamFwdTimer);
         } else {
-          targets = fl::noGrad(
-              batchTarget(paths, dicts[kTargetIdx].getIndex(kEosToken)));
+          auto tgtSlot = stageTarget(
+              hypos,
+              {0, hypos.size()},
+              dicts[kTargetIdx].getIndex(kEosToken),
+              staging);
+          auto staged = staging.upload();
+          auto remIdx = PinnedStagingBuffer::get(staged, remIdxSlot);
+          targets = fl::noGrad(PinnedStagingBuffer::get(staged, tgtSlot));
+          padWaste = paddingWaste(hypos, {{0, hypos.size()}});
           tgtLen = getTargetLength(
               targets.array(), dicts[kTargetIdx].getIndex(kEosToken));
 
-          meters.timer[kLMFwdTimer].resume();
-          lmLogprob =
-              fl::negate(lm->forward({targets, fl::noGrad(tgtLen)}).front());
-          meters.timer[kLMFwdTimer].stopAndIncUnit();
+          // with --lmasync the LM scores the hypotheses on a worker thread
+          // while the criterion runs. lm-fwd then spans from launch to join
+          // and overlaps beam-fwd; lm-wait is the time spent joining.
+          auto scoreLM = [&]() {
+            return fl::negate(
+                lm->forward({targets, fl::noGrad(tgtLen)}).front());
+          };
+          std::future<fl::Variable> lmFuture;
+          if (FLAGS_lpmbalancelm) {
+            // already timed as lm-fwd above
+            lmLogprob = fl::negate(fl::noGrad(balancedScores));
+          } else if (FLAGS_lmasync) {
+            resumeTimer(kLMFwdTimer);
+            int device = af::getDevice();
+            lmFuture = std::async(std::launch::async, [&scoreLM, device]() {
+              af::setDevice(device);
+              return scoreLM();
+            });
+          } else {
+            resumeTimer(kLMFwdTimer);
+            lmLogprob = scoreLM();
+            stopTimer(kLMFwdTimer);
+          }
 
-          meters.timer[kBeamFwdTimer].resume();
-          hypoNums = afToVector<int>(hypoNumsArr(remIdx));
+          resumeTimer(kBeamFwdTimer);
           output =
               batchEncoderOutput(hypoNums, output(af::span, af::span, remIdx));
           loss = criterion->forward({output, targets}).front();
+          if (lmFuture.valid()) {
+            resumeTimer(kLMWaitTimer);
+            lmLogprob = lmFuture.get();
+            stopTimer(kLMWaitTimer);
+            stopTimer(kLMFwdTimer);
+          }
 
-          auto lmRenormProb = adjustProb(lmLogprob, hypoNums, true, true);
+          lmRenormProb = adjustProb(lmLogprob, hypoNums, true, true);
           loss = FLAGS_lmweight * lmRenormProb * loss;
-          meters.timer[kBeamFwdTimer].stopAndIncUnit();
+          stopTimer(kBeamFwdTimer);
+        }
 
-          meters.values[kLen].add(tgtLen);
-          meters.values[kNumHypos].add(static_cast<double>(paths.size()));
+        if (remBs > 0) {
+          addValue(meters.values[kLen], tgtLen);
+          meters.values[kNumHypos].add(static_cast<double>(hypos.size()));
+          meters.values[kPadWaste].add(padWaste);
+          if (FLAGS_lmprefixshare) {
+            meters.values[kLMPrefixSkip].add(lm->takePrefixSkipRatio());
+          }
 
           lment = entropy(lmRenormProb) / static_cast<float>(hypoNums.size());
-          meters.values[kLMEnt].add(lment.array());
-          meters.values[kLMScore].add(lmLogprob.array());
+          addValue(meters.values[kLMEnt], lment.array());
+          addValue(meters.values[kLMScore], lmLogprob.array());
 
-          if (af::anyTrue<bool>(af::isNaN(loss.array()))) {
-            LOG(FATAL) << "LPM loss has NaN values";
-          }
-          meters.values[kLPMLoss].add(loss.array());
+          checkNaN(loss.array(), "LPM loss has NaN values");
+          addValue(meters.values[kLPMLoss], loss.array());
         }
       }
 
-      af::sync();
-      meters.timer[kFwdTimer].stopAndIncUnit();
-      meters.values[kFullLoss].add(loss.array());
+      if (timeIter) {
+        af::sync();
+      }
+      stopTimer(kFwdTimer);
+      addValue(meters.values[kFullLoss], loss.array());
 
       // compute training error rate from parallel data
       if (isPairedData) {
-        auto globalBatchIdx = afToVector<int64_t>(sample[kGlobalBatchIdx]);
-        if (trainEvalIds.find(globalBatchIdx[0]) != trainEvalIds.end()) {
+        if (trainEvalIds.find(globalBatchIdx) != trainEvalIds.end()) {
           evalOutput(
               output.array(),
               sample[kTargetIdx],
@@ -355,72 +750,92 @@ int main(int argc, char** argv) {
       }
 
       // backward
-      meters.timer[kBwdTimer].resume();
-      netoptim->zeroGrad();
-      lm->zeroGrad();
-
-      loss.backward();
+      resumeTimer(kBwdTimer);
+      if (!hasGrads) {
+        loss.backward();
+      }
       if (reducer) {
+        if (reduceAfterBackward) {
+          for (const auto& p : trainParams) {
+            if (p.isGradAvailable()) {
+              reducer->add(p.grad());
+            }
+          }
+        }
         reducer->finalize();
       }
 
-      af::sync();
-      meters.timer[kBwdTimer].stopAndIncUnit();
-      meters.timer[kOptimTimer].resume();
-
-      // scale down gradients by batchsize note that the original batchsize
-      // bs is used instead of remBs, since different workers may have
-      // different remBs. for the sake of simplicity we just use bs.
-      for (const auto& p : network->params()) {
-        if (!p.isGradAvailable()) {
-          continue;
-        }
-        p.grad() = p.grad() / bs;
-      }
-      for (const auto& p : criterion->params()) {
-        if (!p.isGradAvailable()) {
-          continue;
-        }
-        p.grad() = p.grad() / bs;
-      }
-      if (FLAGS_maxgradnorm > 0) {
-        auto params = network->params();
-        auto critparams = criterion->params();
-        params.insert(params.end(), critparams.begin(), critparams.end());
-        fl::clipGradNorm(params, FLAGS_maxgradnorm);
+      if (timeIter) {
+        af::sync();
       }
+      stopTimer(kBwdTimer);
+      resumeTimer(kOptimTimer);
+
+      // scale down gradients by batchsize (and number of workers) and clip
+      // them in a single pass. note that the original batchsize bs is used
+      // instead of remBs, since different workers may have different remBs.
+      // for the sake of simplicity we just use bs.
+      scaleAndClipGradNorm(
+          trainParams, 1.0 / (bs * worldSize), FLAGS_maxgradnorm);
 
       netoptim->step();
-      af::sync();
-      meters.timer[kOptimTimer].stopAndIncUnit();
-      meters.timer[kSampleTimer].resume();
+      if (timeIter) {
+        af::sync();
+      }
+      stopTimer(kOptimTimer);
+      if (timeIter && scheduleTuner.enabled()) {
+        scheduleTuner.stopStep(isPairedData);
+      }
+      if (isTimedIter(curIter + 1)) {
+        meters.timer[kSampleTimer].resume();
+        scheduleTuner.startStep();
+      }
 
-      auto lengths = afToVector<int>(tgtLen);
-      LOG(INFO) << "[ Epoch " << curEpoch << " ]"
-                << " Iter=" << scheduleIter << " isPairedData=" << isPairedData
-                << " AvgLoss=" << fl::mean(loss, {0}).scalar<float>()
-                << " MinLen="
-                << *std::min_element(lengths.begin(), lengths.end())
-                << " MaxLen="
-                << *std::max_element(lengths.begin(), lengths.end());
+      bool isReportIter = (!logOnEpoch && curIter % FLAGS_reportiters == 0) ||
+          (logOnEpoch && scheduleIter == nItersPerEpoch);
+      if (lowSync) {
+        deferredStats.addLoss(fl::mean(loss, {0}).array(), tgtLen);
+        if (isReportIter || curIter % FLAGS_lowsynciters == 0) {
+          deferredStats.flush(
+              "[ Epoch " + std::to_string(curEpoch) +
+              " ] Iter=" + std::to_string(scheduleIter));
+        }
+      } else {
+        auto lengths = afToVector<int>(tgtLen);
+        LOG(INFO) << "[ Epoch " << curEpoch << " ]"
+                  << " Iter=" << scheduleIter
+                  << " isPairedData=" << isPairedData
+                  << " AvgLoss=" << fl::mean(loss, {0}).scalar<float>()
+                  << " MinLen="
+                  << *std::min_element(lengths.begin(), lengths.end())
+                  << " MaxLen="
+                  << *std::max_element(lengths.begin(), lengths.end());
+      }
 
       // checkpoint evaluation
-      if ((!logOnEpoch && curIter % FLAGS_reportiters == 0) ||
-          (logOnEpoch && scheduleIter == nItersPerEpoch)) {
+      if (isReportIter) {
         stopTimeMeters(meters);
         runEval(network, criterion, validds, meters, dicts[kTargetIdx]);
 
         config[kEpoch] = std::to_string(curEpoch);
         config[kIteration] = std::to_string(curIter);
+        config[kEpochIter] = std::to_string(scheduleIter);
+        // the producer may have drawn batches ahead of training
+        config[kSchedulerState] = DataScheduler::serializeState(
+            propProducer ? schedulerState : trainDscheduler.getState());
         std::unordered_map<std::string, double> logFields(
             {{"lr", netoptim->getLr()}});
+        logFields.insert(perfFields.begin(), perfFields.end());
         logHelper.logAndSaveModel(
             meters, config, network, criterion, netoptim, logFields);
 
         resetTrainMeters(meters);
         network->train();
         criterion->train();
-        meters.timer[kSampleTimer].resume();
+        if (isTimedIter(curIter + 1)) {
+          meters.timer[kSampleTimer].resume();
+          scheduleTuner.startStep();
+        }
         meters.timer[kRuntime].resume();
         meters.timer[kTimer].resume();
 
@@ -431,25 +846,71 @@ int main(int argc, char** argv) {
         if ((FLAGS_propupdate == kAlways) ||
             (FLAGS_propupdate == kBetter && properr > newproperr)) {
           LOG_MASTER(INFO) << "Update proposal model to the current model";
-          logHelper.saveModel("prop.bin", config, network, criterion);
           properr = newproperr;
 
-          std::string workerPropPath = logHelper.saveModel(
-              format("prop_worker%03d.bin", worldRank),
-              config,
-              network,
-              criterion,
-              nullptr, // no optimizer for the proposal model
-              true);
-          W2lSerializer::load(workerPropPath, propcfg, propnet, base_propcrit);
-          propcrit = std::dynamic_pointer_cast<Seq2SeqCriterion>(base_propcrit);
-          propnet->eval();
-          propcrit->eval();
+          // the previous prop.bin may still be written from propnet
+          logHelper.waitForSave();
+          {
+            std::unique_lock<std::mutex> propLock;
+            if (propProducer) {
+              propLock = propProducer->lockProposalModel();
+            }
+            refreshProposalModel(network, criterion, propnet, propcrit);
+            if (FLAGS_fp16prop) {
+              convertParams(propnet, f16);
+            }
+            propnet->eval();
+            propcrit->eval();
+            if (propProducer) {
+              propProducer->setProposalModel(propnet, propcrit);
+            }
+          }
+          ++propVersion;
+          if (hypCache) {
+            hypCache->setKey(hypCacheKey(propVersion));
+          }
+          auto propConfig = config;
+          propConfig[kPropVersion] = std::to_string(propVersion);
+          logHelper.saveModelAsync("prop.bin", propConfig, propnet, propcrit);
+        }
+      }
+    }
+
+    // retune the schedule of the next epoch from this epoch's step costs
+    if (scheduleTuner.enabled()) {
+      auto newIters =
+          scheduleTuner.update({FLAGS_pairediter, FLAGS_audioiter});
+      perfFields[kPairedStepSec] = scheduleTuner.pairedStepSec();
+      perfFields[kAudioStepSec] = scheduleTuner.audioStepSec();
+      perfFields[kSchedPairedIter] = newIters[0];
+      perfFields[kSchedAudioIter] = newIters[1];
+      LOG_MASTER(INFO) << "Schedule: paired step "
+                       << scheduleTuner.pairedStepSec() << "s, audio step "
+                       << scheduleTuner.audioStepSec() << "s, pairediter "
+                       << FLAGS_pairediter << " -> " << newIters[0]
+                       << ", audioiter " << FLAGS_audioiter << " -> "
+                       << newIters[1];
+      if (newIters[0] != FLAGS_pairediter || newIters[1] != FLAGS_audioiter) {
+        FLAGS_pairediter = newIters[0];
+        FLAGS_audioiter = newIters[1];
+        // a continued run starts from the tuned schedule, later flags in
+        // the string take precedence
+        config[kGflags] = savedGflags + "\n--pairediter=" +
+            std::to_string(FLAGS_pairediter) +
+            "\n--audioiter=" + std::to_string(FLAGS_audioiter) + "\n";
+        nItersPerEpoch = FLAGS_pairediter + FLAGS_audioiter;
+        if (propProducer) {
+          propProducer->setSchedule(newIters);
+        } else {
+          trainDscheduler.setSchedule(newIters);
         }
       }
     }
     af::sync();
   }
+  if (lowSync) {
+    deferredStats.flush("[ Epoch " + std::to_string(curEpoch) + " ]");
+  }
 
   LOG_MASTER(INFO) << "Finished training";
   return 0;
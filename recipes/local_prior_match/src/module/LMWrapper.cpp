@@ -8,6 +8,14 @@
 
 #include "recipes/models/local_prior_match/src/module/LMWrapper.h"
 
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <numeric>
+#include <unordered_map>
+
+#include "common/FlashlightUtils.h"
+
 using namespace fl;
 
 namespace w2l {
@@ -19,12 +27,23 @@ LMWrapper::LMWrapper(
     : dictIndexMap_(dictIndexMap.size(), dictIndexMap.data()),
       startIndex_(startIndex) {
   add(network);
+  // the LM is only used for scoring, so its parameters are frozen; with
+  // no-grad inputs, forward then records no autograd graph
+  for (auto& param : params()) {
+    param.setCalcGrad(false);
+  }
 }
 
+LMWrapper::LMWrapper(std::shared_ptr<LM> ngram, int eosIndex)
+    : startIndex_(-1), ngram_(ngram), eosIndex_(eosIndex) {}
+
 std::vector<Variable> LMWrapper::forward(const std::vector<Variable>& inputs) {
   if (inputs.size() > 2) {
     throw std::invalid_argument("Invalid inputs size");
   }
+  if (ngram_) {
+    return forwardNgram(inputs);
+  }
 
   // inputs[0] is of size [targetlen, batchsize]
   int U = inputs[0].dims(0);
@@ -36,16 +55,25 @@ std::vector<Variable> LMWrapper::forward(const std::vector<Variable>& inputs) {
   auto idxs = af::flat(inputs[0].array());
   auto input = moddims(noGrad(dictIndexMap_(idxs)), {U, B});
 
+  if (prefixSharing_ && inputs.size() == 2) {
+    return forwardPrefixShared(input, inputs[1]);
+  }
+
   // pad start token
   Variable lmInput = constant(startIndex_, {1, B}, s32, false);
   if (U > 1) {
     lmInput = concatenate({lmInput, input(af::seq(0, U - 2), af::span)}, 0);
   }
 
+  // only the log-probs of the target tokens are gathered from the [V, U, B]
+  // LM output, the full distribution is not kept. V * U * B can exceed the
+  // s32 range, so the index is built in s64.
   auto logProbOutput = lm()->forward({lmInput}).front();
-
-  // [U, B]
-  auto losses = categoricalCrossEntropy(logProbOutput, input, ReduceMode::NONE);
+  int64_t V = logProbOutput.dims(0);
+  auto gatherIdx = af::flat(input.array()).as(s64) +
+      V * af::range(af::dim4(U * B), 0, s64);
+  // [U, B], scores are returned in fp32 whatever the precision of the LM
+  auto losses = negate(moddims(flat(logProbOutput)(gatherIdx), {U, B}).as(f32));
 
   if (inputs.size() == 2) { // mask padding
     auto endIdx = inputs[1].array();
@@ -55,11 +83,160 @@ std::vector<Variable> LMWrapper::forward(const std::vector<Variable>& inputs) {
     losses = noGrad(mask) * losses;
   }
 
-  losses = flat(sum(losses, {0}));
-  return {losses, logProbOutput};
+  return {flat(sum(losses, {0}))};
+}
+
+std::vector<Variable> LMWrapper::forwardPrefixShared(
+    const Variable& input,
+    const Variable& lengths) {
+  int U = input.dims(0);
+  int B = input.dims(1);
+  // tokens [U, B] and lengths [1, B] are read back together, row U holds
+  // the lengths
+  auto tokens = afToVector<int>(af::join(
+      0, input.array(), af::moddims(lengths.array().as(s32), 1, B)));
+  auto token = [&tokens, U](int t, int b) { return tokens[t + (U + 1) * b]; };
+  std::vector<int> lens(B);
+  for (int b = 0; b < B; b++) {
+    lens[b] = std::min(token(U, b), U);
+  }
+
+  // trie over the LM inputs (start token followed by the first len - 1
+  // tokens); node 0 is the start token
+  std::vector<std::unordered_map<int, int>> children(1);
+  auto walk = [&](int b, const std::function<void(int)>& visit) {
+    int node = 0;
+    visit(node);
+    for (int t = 0; t < lens[b] - 1; t++) {
+      int tok = token(t, b);
+      auto it = children[node].find(tok);
+      if (it == children[node].end()) {
+        it = children[node].emplace(tok, children.size()).first;
+        children.emplace_back();
+      }
+      node = it->second;
+      visit(node);
+    }
+  };
+
+  // the longest inputs are scored first; an input whose trie path is already
+  // covered reads its scores off the input that covers it
+  std::vector<int> order(B);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&lens](int b1, int b2) {
+    return lens[b1] > lens[b2];
+  });
+  std::vector<int> cover; // trie node -> covering column of the LM batch
+  std::vector<int> scored; // hypotheses that are run through the LM
+  std::vector<int> column(B); // hypothesis -> column of the LM batch
+  for (int b : order) {
+    int endNode = 0;
+    walk(b, [&endNode](int node) { endNode = node; });
+    cover.resize(children.size(), -1);
+    if (cover[endNode] >= 0) {
+      column[b] = cover[endNode];
+      continue;
+    }
+    column[b] = scored.size();
+    walk(b, [&](int node) {
+      if (cover[node] < 0) {
+        cover[node] = scored.size();
+      }
+    });
+    scored.push_back(b);
+  }
+
+  int maxLen = lens[scored[0]];
+  int nScored = scored.size();
+  prefixInputs_ += B;
+  prefixSkipped_ += B - nScored;
+  std::vector<int> lmTokens(maxLen * nScored, startIndex_);
+  for (int c = 0; c < nScored; c++) {
+    int b = scored[c];
+    auto col = tokens.begin() + (U + 1) * b;
+    std::copy(col, col + lens[b] - 1, lmTokens.begin() + maxLen * c + 1);
+  }
+  auto lmInput = noGrad(af::array(af::dim4(maxLen, nScored), lmTokens.data()));
+  auto logProbOutput = lm()->forward({lmInput}).front();
+  intl V = logProbOutput.dims(0);
+
+  // gather the log-prob of each target token from the covering column; the
+  // index into the [V, maxLen, nScored] output can exceed the int range
+  std::vector<intl> gatherIdx(U * B, 0);
+  std::vector<float> mask(U * B, 0.0);
+  for (int b = 0; b < B; b++) {
+    for (int t = 0; t < lens[b]; t++) {
+      intl pos = t + static_cast<intl>(maxLen) * column[b];
+      gatherIdx[t + U * b] = token(t, b) + V * pos;
+      mask[t + U * b] = 1.0;
+    }
+  }
+  auto logProbs = flat(logProbOutput)(af::array(U * B, gatherIdx.data()));
+  auto maskArr = af::array(af::dim4(U, B), mask.data());
+  auto losses = negate(moddims(logProbs, {U, B}).as(f32)) * noGrad(maskArr);
+  return {flat(sum(losses, {0}))};
+}
+
+double LMWrapper::takePrefixSkipRatio() {
+  double ratio = prefixInputs_ > 0
+      ? static_cast<double>(prefixSkipped_) / prefixInputs_
+      : 0.0;
+  prefixInputs_ = prefixSkipped_ = 0;
+  return ratio;
+}
+
+std::vector<Variable> LMWrapper::forwardNgram(
+    const std::vector<Variable>& inputs) {
+  int U = inputs[0].dims(0);
+  int B = inputs[0].dims(1);
+  auto tokens = afToVector<int>(inputs[0].array());
+  std::vector<int> lens(B, U);
+  if (inputs.size() == 2) {
+    lens = afToVector<int>(inputs[1].array());
+  }
+
+  // LM states are kept in a trie over the targets of the batch, so prefixes
+  // shared across the beam and across utterances are scored once
+  struct Node {
+    LMStatePtr state;
+    double score;
+    std::unordered_map<int, int> children;
+  };
+  std::vector<Node> trie(1);
+  trie[0].state = ngram_->start(false);
+  trie[0].score = 0;
+
+  std::vector<float> scores(B);
+  for (int b = 0; b < B; b++) {
+    int len = std::min(lens[b], U);
+    int node = 0;
+    for (int t = 0; t < len; t++) {
+      int tok = tokens[t + U * b];
+      if (tok == eosIndex_) {
+        break;
+      }
+      auto it = trie[node].children.find(tok);
+      if (it != trie[node].children.end()) {
+        node = it->second;
+        continue;
+      }
+      auto next = ngram_->score(trie[node].state, tok);
+      int child = trie.size();
+      trie[node].children.emplace(tok, child);
+      trie.push_back(Node{next.first, trie[node].score + next.second, {}});
+      node = child;
+    }
+    auto end = ngram_->finish(trie[node].state);
+    // n-gram scores are log10, convert to the natural log of the neural LMs
+    scores[b] = -(trie[node].score + end.second) * std::log(10.0);
+  }
+  return {noGrad(af::array(B, scores.data()))};
 }
 
 std::string LMWrapper::prettyString() const {
+  if (ngram_) {
+    return "LM: n-gram";
+  }
   return "LM: " + lm()->prettyString();
 }
 
@@ -13,9 +13,12 @@
 #include <string>
 #include <vector>
 
+#include "libraries/lm/LM.h"
+
 namespace w2l {
 
-// a simple wrapper for LMs trained with a different dictionary
+// a simple wrapper for LMs trained with a different dictionary; the wrapped
+// LM is frozen and only used for inference
 class LMWrapper : public fl::Container {
  public:
   LMWrapper(
@@ -23,14 +26,44 @@ class LMWrapper : public fl::Container {
       const std::vector<int>& dictIndexMap,
       int startIndex);
 
+  /**
+   * Wrap an n-gram LM (e.g. KenLM), scored on the CPU.
+   * @param ngram The LM, built on the dictionary of the target tokens.
+   * @param eosIndex Index of the eos token in that dictionary; the end of a
+   * target is scored with `LM::finish`.
+   */
+  LMWrapper(std::shared_ptr<LM> ngram, int eosIndex);
+
+  // inputs: targets [U, B] and optionally their lengths [B]; returns the
+  // negative log-prob of each target sequence [B]
   std::vector<fl::Variable> forward(
       const std::vector<fl::Variable>& inputs) override;
 
   std::string prettyString() const override;
 
+  /**
+   * Only run the LM over the inputs that are not a prefix of another input of
+   * the batch, and read the scores of the others off the longer ones. This
+   * requires a causal LM and the target lengths as second input.
+   */
+  void setPrefixSharing(bool prefixSharing) {
+    prefixSharing_ = prefixSharing;
+  }
+
+  /**
+   * Fraction of the inputs that prefix sharing did not run through the LM,
+   * over the forwards since the last call.
+   */
+  double takePrefixSkipRatio();
+
  private:
   af::array dictIndexMap_;
   int startIndex_;
+  bool prefixSharing_{false};
+  int64_t prefixInputs_{0};
+  int64_t prefixSkipped_{0};
+  std::shared_ptr<LM> ngram_;
+  int eosIndex_{-1};
 
   FL_SAVE_LOAD_WITH_BASE(Container, dictIndexMap_, startIndex_)
 
@@ -39,6 +72,13 @@ class LMWrapper : public fl::Container {
   std::shared_ptr<fl::Module> lm() const {
     return module(0);
   }
+
+  std::vector<fl::Variable> forwardPrefixShared(
+      const fl::Variable& input,
+      const fl::Variable& lengths);
+
+  std::vector<fl::Variable> forwardNgram(
+      const std::vector<fl::Variable>& inputs);
 };
 
 } // namespace w2l
@@ -11,6 +11,7 @@
 #include <algorithm>
 #include <limits>
 #include <numeric>
+#include <sstream>
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
@@ -25,26 +26,52 @@ DataScheduler::DataScheduler(
     const std::vector<std::shared_ptr<W2lDataset>>& datasets,
     const std::vector<int64_t>& dataTypes,
     const std::vector<int64_t>& numIters,
-    int64_t curEpoch /* = 1 */)
+    int64_t curEpoch /* = 1 */,
+    int64_t prefetchDepth /* = 0 */,
+    int64_t prefetchThreads /* = 1 */,
+    bool datasetPrefetch /* = false */)
     : ds_(datasets.begin(), datasets.end()),
       dataTypes_(dataTypes.begin(), dataTypes.end()),
       dsNumIters_(numIters.begin(), numIters.end()),
       dsCurIter_(ds_.size(), 0),
       dsIterOffset_(ds_.size(), 0),
       dsCurEpochs_(ds_.size(), curEpoch),
-      gen_(FLAGS_seed) {
+      lastDataType_(-1),
+      lastGlobalBatchIdx_(-1),
+      dsOrderEpoch_(ds_.size(), -1),
+      dsBaseEpochs_(ds_.size(), curEpoch),
+      dsPerm_(ds_.size()),
+      gen_(FLAGS_seed),
+      prefetchDepth_(std::max<int64_t>(prefetchDepth, 0)),
+      stopWorkers_(false),
+      datasetPrefetch_(datasetPrefetch) {
   LOG_IF(FATAL, datasets.size() == 0) << "No datasets to be added";
   LOG_IF(FATAL, ds_.size() != dataTypes_.size())
       << "mismatch between the number of datasets "
       << "and the number data types specified";
 
-  if (!FLAGS_noresample) {
-    for (auto& d : ds_) {
-      LOG_MASTER(INFO) << "Shuffling trainset";
-      d->shuffle(curEpoch);
+  initialize();
+
+  for (int i = 0; i < ds_.size(); ++i) {
+    dsMutex_.emplace_back(new std::mutex());
+  }
+  if (prefetchDepth_ > 0) {
+    int device = af::getDevice();
+    for (int i = 0; i < std::max<int64_t>(prefetchThreads, 1); ++i) {
+      workers_.emplace_back([this, device]() { workerLoop(device); });
     }
   }
-  initialize();
+}
+
+DataScheduler::~DataScheduler() {
+  {
+    std::lock_guard<std::mutex> lock(tasksMutex_);
+    stopWorkers_ = true;
+  }
+  tasksCv_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
 }
 
 void DataScheduler::initialize() {
@@ -85,23 +112,97 @@ void DataScheduler::initialize() {
 }
 
 std::vector<af::array> DataScheduler::get() {
-  auto idx = (dsIterOffset_[curDs_] + dsCurIter_[curDs_]) % ds_[curDs_]->size();
-  auto sample = ds_[curDs_]->get(idx);
-  auto globalBatchIdx = ds_[curDs_]->getGlobalBatchIdx(idx);
-  sample.emplace_back(af::constant(dataTypes_[curDs_], 1, s64));
-  sample.emplace_back(af::constant(globalBatchIdx, 1, s64));
+  if (prefetchDepth_ == 0) {
+    auto idx = nextIndex(curDs_);
+    lastDataType_ = dataTypes_[curDs_];
+    lastGlobalBatchIdx_ = ds_[curDs_]->getGlobalBatchIdx(idx);
+    auto sample = load(curDs_, idx);
+    update();
+    return sample;
+  }
 
-  update();
+  prefetch(true);
+  auto sample = prefetched_.front().sample.get();
+  lastDataType_ = prefetched_.front().dataType;
+  lastGlobalBatchIdx_ = prefetched_.front().globalBatchIdx;
+  prefetched_.pop_front();
+  // the batch just returned may still be held by the caller
+  prefetch(false);
+  return sample;
+}
+
+std::vector<af::array> DataScheduler::load(size_t ds, int64_t idx) {
+  std::unique_lock<std::mutex> lock(*dsMutex_[ds], std::defer_lock);
+  if (datasetPrefetch_) {
+    lock.lock();
+  }
+  auto sample = ds_[ds]->get(idx);
+  auto globalBatchIdx = ds_[ds]->getGlobalBatchIdx(idx);
+  sample.emplace_back(af::constant(dataTypes_[ds], 1, s64));
+  sample.emplace_back(af::constant(globalBatchIdx, 1, s64));
   return sample;
 }
 
+void DataScheduler::prefetch(bool allowReshuffle) {
+  while (prefetched_.size() < prefetchDepth_) {
+    auto ds = curDs_;
+    if (needsReshuffle(ds) && (!allowReshuffle || !prefetched_.empty())) {
+      return;
+    }
+    auto idx = nextIndex(ds);
+    std::packaged_task<std::vector<af::array>()> task(
+        [this, ds, idx]() { return load(ds, idx); });
+    prefetched_.push_back({task.get_future(),
+                           dataTypes_[ds],
+                           ds_[ds]->getGlobalBatchIdx(idx),
+                           currentState()});
+    {
+      std::lock_guard<std::mutex> lock(tasksMutex_);
+      tasks_.push_back(std::move(task));
+    }
+    tasksCv_.notify_one();
+    update();
+  }
+}
+
+void DataScheduler::dropPrefetched() {
+  {
+    std::lock_guard<std::mutex> lock(tasksMutex_);
+    tasks_.clear();
+  }
+  // the futures of the cleared tasks are ready (broken promise), running
+  // loads have to finish before a dataset can be reshuffled
+  for (auto& batch : prefetched_) {
+    batch.sample.wait();
+  }
+  prefetched_.clear();
+}
+
+void DataScheduler::workerLoop(int device) {
+  af::setDevice(device);
+  while (true) {
+    std::packaged_task<std::vector<af::array>()> task;
+    {
+      std::unique_lock<std::mutex> lock(tasksMutex_);
+      tasksCv_.wait(lock, [this]() { return stopWorkers_ || !tasks_.empty(); });
+      if (tasks_.empty()) {
+        return;
+      }
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    task();
+  }
+}
+
 void DataScheduler::update() {
   ++dsCurIter_[curDs_];
 
   if (!FLAGS_noresample &&
       (dsIterOffset_[curDs_] + dsCurIter_[curDs_]) % ds_[curDs_]->size() == 0) {
-    LOG_MASTER(INFO) << "Shuffling trainset";
-    ds_[curDs_]->shuffle(++dsCurEpochs_[curDs_] /* seed */);
+    ++dsCurEpochs_[curDs_];
+    LOG_MASTER(INFO) << "Trainset " << curDs_ << " starts epoch "
+                     << dsCurEpochs_[curDs_];
   }
 
   if (FLAGS_schedulerorder == kInOrder) {
@@ -145,6 +246,12 @@ std::vector<int64_t> DataScheduler::getSchedule() {
 }
 
 void DataScheduler::setSchedule(std::vector<int64_t> newIters) {
+  // the batches in flight were picked under the old schedule, rewind to the
+  // first of them
+  if (!prefetched_.empty()) {
+    auto state = prefetched_.front().state;
+    setState(state);
+  }
   dsNumIters_ = std::move(newIters);
   initialize();
   for (int i = 0; i < dsCurIter_.size(); ++i) {
@@ -152,4 +259,121 @@ void DataScheduler::setSchedule(std::vector<int64_t> newIters) {
     dsCurIter_[i] = 0;
   }
 }
+
+bool DataScheduler::needsReshuffle(size_t ds) const {
+  return !FLAGS_noresample && !FLAGS_lazyshuffle &&
+      dsOrderEpoch_[ds] != dsCurEpochs_[ds];
+}
+
+bool DataScheduler::reshufflePending() const {
+  return prefetched_.empty() && needsReshuffle(curDs_);
+}
+
+void DataScheduler::reshuffle(size_t ds) {
+  if (FLAGS_lazyshuffle) {
+    dsPerm_[ds] = LazyPermutation(ds_[ds]->size(), dsCurEpochs_[ds] /* seed */);
+    dsOrderEpoch_[ds] = dsCurEpochs_[ds];
+    return;
+  }
+  // W2lDataset::shuffle reorders the current order, so the order of an epoch
+  // is the result of the shuffles of all epochs from the base epoch on. They
+  // are replayed from the freshly loaded order after a restored state.
+  auto epoch =
+      dsOrderEpoch_[ds] < 0 ? dsBaseEpochs_[ds] : dsOrderEpoch_[ds] + 1;
+  for (; epoch <= dsCurEpochs_[ds]; ++epoch) {
+    LOG_MASTER(INFO) << "Shuffling trainset " << ds << " for epoch " << epoch;
+    ds_[ds]->shuffle(epoch /* seed */);
+  }
+  dsOrderEpoch_[ds] = dsCurEpochs_[ds];
+}
+
+int64_t DataScheduler::nextIndex(size_t ds) {
+  auto idx = (dsIterOffset_[ds] + dsCurIter_[ds]) % ds_[ds]->size();
+  if (FLAGS_noresample) {
+    return idx;
+  }
+  if (dsOrderEpoch_[ds] != dsCurEpochs_[ds]) {
+    reshuffle(ds);
+  }
+  return FLAGS_lazyshuffle ? dsPerm_[ds](idx) : idx;
+}
+
+DataScheduler::State DataScheduler::currentState() const {
+  return State{dsCumNumIters_,
+               dsCurIter_,
+               dsIterOffset_,
+               dsCurEpochs_,
+               dsBaseEpochs_,
+               curDs_,
+               gen_};
+}
+
+DataScheduler::State DataScheduler::getState() const {
+  // prefetched batches are not handed out yet
+  return prefetched_.empty() ? currentState() : prefetched_.front().state;
+}
+
+void DataScheduler::setState(const State& state) {
+  LOG_IF(FATAL, state.dsCurIter.size() != ds_.size())
+      << "DataScheduler state does not match the number of datasets";
+
+  dropPrefetched();
+
+  // an in-place shuffle cannot be undone, `reshufflePending()` keeps rewinds
+  // within the current order
+  for (int i = 0; i < ds_.size(); ++i) {
+    LOG_IF(
+        FATAL,
+        !FLAGS_lazyshuffle && dsOrderEpoch_[i] >= 0 &&
+            (state.dsBaseEpochs[i] != dsBaseEpochs_[i] ||
+             state.dsCurEpochs[i] < dsOrderEpoch_[i]))
+        << "DataScheduler cannot rewind trainset " << i
+        << " past its last shuffle";
+  }
+
+  dsCumNumIters_ = state.dsCumNumIters;
+  dsCurIter_ = state.dsCurIter;
+  dsIterOffset_ = state.dsIterOffset;
+  dsCurEpochs_ = state.dsCurEpochs;
+  dsBaseEpochs_ = state.dsBaseEpochs;
+  curDs_ = state.curDs;
+  gen_ = state.gen;
+}
+
+std::string DataScheduler::serializeState(const State& state) {
+  std::ostringstream oss;
+  for (const auto* vec : {&state.dsCumNumIters,
+                          &state.dsCurIter,
+                          &state.dsIterOffset,
+                          &state.dsCurEpochs,
+                          &state.dsBaseEpochs}) {
+    oss << vec->size();
+    for (auto v : *vec) {
+      oss << " " << v;
+    }
+    oss << " ";
+  }
+  oss << state.curDs << " " << state.gen;
+  return oss.str();
+}
+
+DataScheduler::State DataScheduler::deserializeState(const std::string& str) {
+  State state;
+  std::istringstream iss(str);
+  for (auto* vec : {&state.dsCumNumIters,
+                    &state.dsCurIter,
+                    &state.dsIterOffset,
+                    &state.dsCurEpochs,
+                    &state.dsBaseEpochs}) {
+    size_t size;
+    iss >> size;
+    vec->resize(size);
+    for (auto& v : *vec) {
+      iss >> v;
+    }
+  }
+  iss >> state.curDs >> state.gen;
+  LOG_IF(FATAL, !iss) << "Invalid DataScheduler state: " << str;
+  return state;
+}
 } // namespace w2l
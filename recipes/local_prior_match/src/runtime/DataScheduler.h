@@ -8,19 +8,38 @@
 
 #pragma once
 
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
 #include <random>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
 #include <flashlight/flashlight.h>
 
 #include "data/W2lDataset.h"
+#include "recipes/models/local_prior_match/src/runtime/LazyPermutation.h"
 
 namespace w2l {
 
 class DataScheduler {
  public:
+  // position in the schedule, enough to resume at the exact next batch
+  struct State {
+    std::vector<int64_t> dsCumNumIters;
+    std::vector<int64_t> dsCurIter;
+    std::vector<int64_t> dsIterOffset;
+    std::vector<int64_t> dsCurEpochs;
+    // epoch of the first shuffle of each dataset, see `reshuffle()`
+    std::vector<int64_t> dsBaseEpochs;
+    size_t curDs;
+    std::mt19937 gen;
+  };
+
   /** The `DataScheduler` class constructor.
    * @param datasets Pointers to the datasets.
    * @param dataTypes Each dataset's type (kParallelData or kUnpairedAudio).
@@ -28,20 +47,63 @@ class DataScheduler {
    * the next dataset.
    * @param curEpoch Number of epochs that the datasets have been iterated
    * through for dataset shuffling use.
+   * @param prefetchDepth Number of batches loaded ahead in the background,
+   * in the same order as without prefetch. If 0, each batch is loaded when
+   * it is requested.
+   * @param prefetchThreads Number of background workers loading batches.
+   * @param datasetPrefetch Whether the datasets prefetch batches themselves
+   * (W2lDataset with --nthread > 0). Their `get` is then not thread-safe, so
+   * the workers serialize the loads from each dataset.
    */
   DataScheduler(
       const std::vector<std::shared_ptr<W2lDataset>>& datasets,
       const std::vector<int64_t>& dataTypes,
       const std::vector<int64_t>& numIters,
-      int64_t curEpoch = 1);
+      int64_t curEpoch = 1,
+      int64_t prefetchDepth = 0,
+      int64_t prefetchThreads = 1,
+      bool datasetPrefetch = false);
+
+  ~DataScheduler();
 
   // sequentially access the data according to the schedule
   std::vector<af::array> get();
 
+  // data type of the batch last returned by `get()`, known without reading
+  // back the sample
+  int64_t getDataType() const {
+    return lastDataType_;
+  }
+
+  // global batch index of the batch last returned by `get()`, also known
+  // without reading back the sample
+  int64_t getGlobalBatchIdx() const {
+    return lastGlobalBatchIdx_;
+  }
+
+  /**
+   * Whether the next `get()` reshuffles a dataset in place. A caller that
+   * keeps batches of its own ahead of training (see ProposalProducer) has to
+   * hand them out first, so that `setState()` can still rewind to them.
+   */
+  bool reshufflePending() const;
+
   std::vector<int64_t> getSchedule();
 
+  // batches already prefetched are dropped and picked again under the new
+  // schedule, so the scheduler state stays consistent with it
   void setSchedule(std::vector<int64_t> newIters);
 
+  // state after the batches returned by `get()` so far
+  State getState() const;
+
+  // resume from `state`, prefetched batches are dropped
+  void setState(const State& state);
+
+  static std::string serializeState(const State& state);
+
+  static State deserializeState(const std::string& str);
+
  private:
   std::vector<std::shared_ptr<W2lDataset>> ds_;
   std::vector<int64_t> dataTypes_;
@@ -51,14 +113,71 @@ class DataScheduler {
   std::vector<int64_t> dsIterOffset_;
   std::vector<int64_t> dsCurEpochs_;
   size_t curDs_;
+  int64_t lastDataType_;
+  int64_t lastGlobalBatchIdx_;
+
+  // Epoch the batch order of each dataset was built for, -1 if not built
+  // yet. By default the dataset itself is shuffled in place, seeded by each
+  // epoch from `dsBaseEpochs_` on, so the datasets are read in sequence and
+  // their own prefetch applies. With FLAGS_lazyshuffle the order is the
+  // permutation `dsPerm_`, seeded by the current epoch only.
+  std::vector<int64_t> dsOrderEpoch_;
+  std::vector<int64_t> dsBaseEpochs_;
+  std::vector<LazyPermutation> dsPerm_;
 
   std::mt19937 gen_;
 
-  DataScheduler() {}
+  // With prefetchDepth_ > 0, the batches of the next picks of the
+  // schedule are loaded ahead by a pool of workers. Picks, including the
+  // mapping through the batch order, are made in order on the calling
+  // thread, so the order is the same as without prefetch. A dataset is only
+  // reshuffled in place once the batches picked from its previous order are
+  // handed out.
+  size_t prefetchDepth_;
+  struct Prefetched {
+    std::future<std::vector<af::array>> sample;
+    int64_t dataType;
+    int64_t globalBatchIdx;
+    // scheduler state before the batch was picked
+    State state;
+  };
+  std::deque<Prefetched> prefetched_;
+  std::deque<std::packaged_task<std::vector<af::array>()>> tasks_;
+  std::vector<std::thread> workers_;
+  std::mutex tasksMutex_;
+  std::condition_variable tasksCv_;
+  bool stopWorkers_;
+  // W2lDataset::get is not thread-safe while the dataset prefetches, loads
+  // from one dataset are then serialized
+  bool datasetPrefetch_;
+  std::vector<std::unique_ptr<std::mutex>> dsMutex_;
 
   void initialize();
 
   void update();
+
+  // whether `ds` has to be reshuffled in place before its next pick
+  bool needsReshuffle(size_t ds) const;
+
+  // build the batch order of `ds` for its current epoch
+  void reshuffle(size_t ds);
+
+  // dataset index of the next batch of `ds`
+  int64_t nextIndex(size_t ds);
+
+  State currentState() const;
+
+  std::vector<af::array> load(size_t ds, int64_t idx);
+
+  // pick and enqueue batches until prefetchDepth_ are in flight, or until a
+  // pick needs an in-place reshuffle that is not allowed yet: only with
+  // `allowReshuffle` and no batch in flight
+  void prefetch(bool allowReshuffle);
+
+  // drop the batches in flight, waiting for the loads already running
+  void dropPrefetched();
+
+  void workerLoop(int device);
 };
 
 } // namespace w2l
@@ -24,9 +24,67 @@ DEFINE_string(
     schedulerorder,
     kUniformOrder,
     "the access order between the datasets in the data scheduler (uniform, inorder, random)");
+DEFINE_string(
+    unpaireddataorder,
+    "",
+    "Data order for the unpaired audio set, e.g. output_spiral to bucket utterances by duration and then by the reference length from decode_len_lpm. Uses --dataorder if empty");
+DEFINE_int64(
+    unpairedinputbinsize,
+    -1,
+    "Input bin size used when bucketing the unpaired audio set. Uses --inputbinsize if <0");
+DEFINE_int64(
+    unpairedoutputbinsize,
+    -1,
+    "Output bin size used when bucketing the unpaired audio set. Uses --outputbinsize if <0");
+DEFINE_double(
+    schedepochsec,
+    0,
+    "Target wall-clock seconds per epoch. After every epoch --pairediter and --audioiter are rescaled from the measured step costs (see --timersampleiters). 0 disables");
+DEFINE_double(
+    schedaudioratio,
+    0,
+    "Target fraction of the epoch time spent on unpaired audio steps, adjusted like --schedepochsec. 0 disables");
+DEFINE_int64(
+    schedulerprefetch,
+    0,
+    "Number of batches the data scheduler loads ahead in the background, in the same order as without prefetch. Set to 0 to load each batch when it is requested. A dataset is only reshuffled once the batches already loaded from it are used");
+DEFINE_int64(
+    schedulerthreads,
+    2,
+    "Number of background workers loading batches for the data scheduler. Loads from the same dataset are serialized while the datasets prefetch themselves (--nthread > 0)");
+DEFINE_bool(
+    lazyshuffle,
+    false,
+    "Shuffle the batch order of the training sets with a pseudo-random permutation computed per index, instead of shuffling a set in place when it wraps around. The sets are then read out of order, so their own prefetch (--nthread) misses; requires --schedulerprefetch > 0");
 
 // lm
 DEFINE_string(lmdict, "", "Dictionary used in LM training");
+DEFINE_string(
+    lpmlmtype,
+    kNeuralLM,
+    "Type of the prior LM given by --lm (neural, kenlm). A kenlm LM is built on the tokens of the acoustic model and does not need --lmdict");
+DEFINE_bool(
+    lmasync,
+    false,
+    "Score the hypotheses with the LM on a worker thread, concurrently with the criterion forward. Not used with --lpmtokenbudget");
+DEFINE_bool(
+    lmprefixshare,
+    false,
+    "Only run the LM over hypotheses that are not a prefix of another hypothesis of the batch and reuse their scores for the others. Requires a causal LM. The targets are read back to the host to find the prefixes; the fraction of hypotheses skipped is reported as lm-prefix-skip");
+
+// precision
+DEFINE_bool(fp16prop, false, "Run the proposal network in half precision");
+DEFINE_bool(fp16lm, false, "Run the LM in half precision");
+
+// training loop
+DEFINE_int64(
+    lowsynciters,
+    0,
+    "Keep NaN checks and training meters on the device and only read them back every this many iterations and at report time. Set to 0 to check every iteration. Gradient clipping (--maxgradnorm > 0) still reads back the gradient norm every iteration");
+DEFINE_int64(
+    timersampleiters,
+    1,
+    "Only measure the per-phase timers, which need device syncs, every this many iterations");
 
 // within-beam prior-match
 DEFINE_int64(lpmBeamsz, 4, "Beam size for prior matching objective");
@@ -47,5 +105,25 @@ DEFINE_string(
     propupdate,
     kBetter,
     "Update rule for proposal model (never, always, better)");
+DEFINE_int64(
+    lpmtokenbudget,
+    0,
+    "Maximum number of padded target tokens per micro-batch in the unpaired step, gradients are accumulated over micro-batches. Set to 0 to process all hypotheses at once");
+DEFINE_int64(
+    propqueuesize,
+    0,
+    "Number of batches for which proposal hypotheses are generated ahead on a worker thread. Set to 0 to generate them inline");
+DEFINE_int64(
+    propmaxstale,
+    1,
+    "Regenerate prefetched hypotheses that come from a proposal model more than this many updates old");
+DEFINE_bool(
+    hypcache,
+    false,
+    "Cache the filtered hypotheses of unpaired utterances in memory and on disk until the proposal model is updated. Not supported with --propqueuesize");
+DEFINE_bool(
+    lpmbalancelm,
+    false,
+    "Gather the filtered hypotheses of all ranks and let every rank score an equal share of them with the LM");
 
 } // namespace w2l
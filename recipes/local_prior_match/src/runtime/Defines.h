@@ -23,6 +23,10 @@ constexpr const char* kPropPath = "propPath";
 constexpr const char* kRunStatus = "runStatus";
 constexpr const char* kStartEpoch = "startEpoch";
 constexpr const char* kStartIter = "startIter";
+constexpr const char* kPropVersion = "propVersion";
+constexpr const char* kSchedulerState = "schedulerState";
+constexpr const char* kEpochIter = "epochIter";
+constexpr const char* kStartEpochIter = "startEpochIter";
 
 // meter
 constexpr const char* kTarget = "L";
@@ -38,12 +42,23 @@ constexpr const char* kCritFwdTimer = "crit-fwd";
 constexpr const char* kBeamTimer = "beam";
 constexpr const char* kBeamFwdTimer = "beam-fwd";
 constexpr const char* kLMFwdTimer = "lm-fwd";
+constexpr const char* kLMWaitTimer = "lm-wait";
 constexpr const char* kBwdTimer = "bwd";
 constexpr const char* kOptimTimer = "optim";
 constexpr const char* kNumHypos = "num-hypo";
 constexpr const char* kLMEnt = "lm-ent";
 constexpr const char* kLMScore = "lm-score";
 constexpr const char* kLen = "len";
+constexpr const char* kPadWaste = "pad-waste";
+constexpr const char* kHypImbalance = "hyp-imbalance";
+constexpr const char* kLMImbalance = "lm-imbalance";
+constexpr const char* kLMPrefixSkip = "lm-prefix-skip";
+constexpr const char* kPropFp16Speedup = "prop-fp16-speedup";
+constexpr const char* kLMFp16Speedup = "lm-fp16-speedup";
+constexpr const char* kSchedPairedIter = "sched-paired-iter";
+constexpr const char* kSchedAudioIter = "sched-audio-iter";
+constexpr const char* kPairedStepSec = "paired-step-sec";
+constexpr const char* kAudioStepSec = "audio-step-sec";
 
 // data
 // continue from src/common/Defines.h
@@ -55,6 +70,10 @@ constexpr const char* kRandomOrder = "random";
 constexpr const char* kInOrder = "inorder";
 constexpr const char* kUniformOrder = "uniform";
 
+// prior LM type
+constexpr const char* kNeuralLM = "neural";
+constexpr const char* kNgramLM = "kenlm";
+
 // proposal-update type
 constexpr const char* kNever = "never";
 constexpr const char* kAlways = "always";
@@ -67,9 +86,28 @@ DECLARE_int64(pairediter);
 DECLARE_int64(audioiter);
 DECLARE_string(schedulerorder);
 DECLARE_int64(unpairedBatchsize);
+DECLARE_int64(schedulerprefetch);
+DECLARE_int64(schedulerthreads);
+DECLARE_bool(lazyshuffle);
+DECLARE_string(unpaireddataorder);
+DECLARE_int64(unpairedinputbinsize);
+DECLARE_int64(unpairedoutputbinsize);
+DECLARE_double(schedepochsec);
+DECLARE_double(schedaudioratio);
 
 // lm
 DECLARE_string(lmdict);
+DECLARE_string(lpmlmtype);
+DECLARE_bool(lmasync);
+DECLARE_bool(lmprefixshare);
+
+// precision
+DECLARE_bool(fp16prop);
+DECLARE_bool(fp16lm);
+
+// training loop
+DECLARE_int64(lowsynciters);
+DECLARE_int64(timersampleiters);
 
 // within-beam prior matching
 DECLARE_int64(lpmBeamsz);
@@ -77,5 +115,10 @@ DECLARE_double(hyplenratiolb);
 DECLARE_double(hyplenratioub);
 DECLARE_string(proposalModel);
 DECLARE_string(propupdate);
+DECLARE_int64(lpmtokenbudget);
+DECLARE_int64(propqueuesize);
+DECLARE_int64(propmaxstale);
+DECLARE_bool(hypcache);
+DECLARE_bool(lpmbalancelm);
 
 } // namespace w2l
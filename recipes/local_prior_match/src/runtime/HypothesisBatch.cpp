@@ -0,0 +1,76 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "recipes/models/local_prior_match/src/runtime/HypothesisBatch.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+namespace w2l {
+
+void HypothesisBatch::clear() {
+  tokens.clear();
+  offsets.assign(1, 0);
+  scores.clear();
+  hypoNums.clear();
+}
+
+void HypothesisBatch::add(const int* begin, const int* end, float score) {
+  tokens.insert(tokens.end(), begin, end);
+  offsets.push_back(tokens.size());
+  scores.push_back(score);
+}
+
+void HypothesisBatch::append(const HypothesisBatch& other) {
+  int base = tokens.size();
+  tokens.insert(tokens.end(), other.tokens.begin(), other.tokens.end());
+  for (int i = 1; i < other.offsets.size(); i++) {
+    offsets.push_back(base + other.offsets[i]);
+  }
+  scores.insert(scores.end(), other.scores.begin(), other.scores.end());
+  hypoNums.insert(hypoNums.end(), other.hypoNums.begin(), other.hypoNums.end());
+}
+
+void HypothesisBatch::filter(const std::vector<bool>& keep) {
+  if (keep.size() != size()) {
+    throw std::runtime_error(
+        "size of keep (" + std::to_string(keep.size()) +
+        ") and number of hypotheses (" + std::to_string(size()) +
+        ") do not match");
+  }
+
+  // compact tokens, offsets and scores in place; `offsets[i]` is only
+  // overwritten after hypothesis i has been moved
+  int newSize = 0, newTokens = 0, i = 0;
+  for (auto& hypoNum : hypoNums) {
+    int newHypoNum = 0;
+    for (int end = i + hypoNum; i < end; i++) {
+      if (!keep[i]) {
+        continue;
+      }
+      int len = length(i);
+      std::copy(
+          tokens.begin() + offsets[i],
+          tokens.begin() + offsets[i + 1],
+          tokens.begin() + newTokens);
+      offsets[newSize] = newTokens;
+      scores[newSize] = scores[i];
+      newTokens += len;
+      ++newSize;
+      ++newHypoNum;
+    }
+    hypoNum = newHypoNum;
+  }
+  tokens.resize(newTokens);
+  offsets.resize(newSize + 1);
+  offsets[newSize] = newTokens;
+  scores.resize(newSize);
+}
+
+} // namespace w2l
@@ -0,0 +1,56 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <vector>
+
+namespace w2l {
+
+/**
+ * Beam search hypotheses of a batch of utterances, stored flat. Hypothesis i
+ * holds the tokens [offsets[i], offsets[i + 1]) of `tokens` and has the score
+ * `scores[i]`. Hypotheses are grouped by utterance, `hypoNums[b]` of them for
+ * utterance b.
+ */
+struct HypothesisBatch {
+  std::vector<int> tokens;
+  std::vector<int> offsets = {0};
+  std::vector<float> scores;
+  std::vector<int> hypoNums;
+
+  // number of hypotheses
+  int size() const {
+    return scores.size();
+  }
+
+  int length(int i) const {
+    return offsets[i + 1] - offsets[i];
+  }
+
+  const int* begin(int i) const {
+    return tokens.data() + offsets[i];
+  }
+
+  const int* end(int i) const {
+    return tokens.data() + offsets[i + 1];
+  }
+
+  void clear();
+
+  // append a hypothesis to the last utterance; `hypoNums` is not updated
+  void add(const int* begin, const int* end, float score);
+
+  // append all utterances of `other`
+  void append(const HypothesisBatch& other);
+
+  // drop the hypotheses i with !keep[i] in place and update `hypoNums`
+  void filter(const std::vector<bool>& keep);
+};
+
+} // namespace w2l
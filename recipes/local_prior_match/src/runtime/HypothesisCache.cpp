@@ -0,0 +1,161 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "recipes/models/local_prior_match/src/runtime/HypothesisCache.h"
+
+#include <cstdio>
+#include <stdexcept>
+
+#include <glog/logging.h>
+
+#include "common/Utils.h"
+
+namespace w2l {
+
+namespace {
+
+template <typename T>
+void writeValue(std::ofstream& file, const T& val) {
+  file.write(reinterpret_cast<const char*>(&val), sizeof(T));
+}
+
+template <typename T>
+bool readValue(std::ifstream& file, T& val) {
+  return static_cast<bool>(file.read(reinterpret_cast<char*>(&val), sizeof(T)));
+}
+
+} // namespace
+
+HypothesisCache::HypothesisCache(const std::string& cacheDir, int worldRank)
+    : cacheDir_(cacheDir), worldRank_(worldRank) {}
+
+void HypothesisCache::setKey(const std::string& key) {
+  auto cacheFile = pathsConcat(
+      cacheDir_, format("%s_rank%03d.bin", key.c_str(), worldRank_));
+  if (cacheFile == cacheFile_) {
+    return;
+  }
+
+  if (file_.is_open()) {
+    file_.close();
+  }
+  if (!cacheFile_.empty()) {
+    std::remove(cacheFile_.c_str());
+  }
+  cache_.clear();
+  cacheFile_ = cacheFile;
+
+  bool truncated = load();
+  // a truncated file (e.g. from a killed job) is rewritten from its valid
+  // entries so that new entries can be appended
+  auto mode = std::ios::binary | (truncated ? std::ios::trunc : std::ios::app);
+  file_.open(cacheFile_, mode);
+  if (!file_.is_open()) {
+    throw std::runtime_error("failed to open " + cacheFile_ + " for writing");
+  }
+  if (truncated) {
+    for (const auto& entry : cache_) {
+      writeEntry(entry.first, entry.second);
+    }
+    file_.flush();
+  }
+}
+
+bool HypothesisCache::get(
+    const std::vector<std::string>& sampleIds,
+    HypothesisBatch& hypos) const {
+  for (const auto& id : sampleIds) {
+    if (cache_.find(id) == cache_.end()) {
+      return false;
+    }
+  }
+
+  hypos.clear();
+  for (const auto& id : sampleIds) {
+    hypos.append(cache_.at(id));
+  }
+  return true;
+}
+
+void HypothesisCache::put(
+    const std::vector<std::string>& sampleIds,
+    const HypothesisBatch& hypos) {
+  if (sampleIds.size() != hypos.hypoNums.size()) {
+    throw std::runtime_error(
+        "size of sampleIds (" + std::to_string(sampleIds.size()) +
+        ") and hypoNums (" + std::to_string(hypos.hypoNums.size()) +
+        ") do not match");
+  }
+
+  int offset = 0;
+  for (int b = 0; b < sampleIds.size(); b++) {
+    HypothesisBatch uttHypos;
+    for (int i = offset; i < offset + hypos.hypoNums[b]; i++) {
+      uttHypos.add(hypos.begin(i), hypos.end(i), hypos.scores[i]);
+    }
+    uttHypos.hypoNums.push_back(hypos.hypoNums[b]);
+    offset += hypos.hypoNums[b];
+    writeEntry(sampleIds[b], uttHypos);
+    cache_[sampleIds[b]] = std::move(uttHypos);
+  }
+  file_.flush();
+}
+
+void HypothesisCache::writeEntry(
+    const std::string& id,
+    const HypothesisBatch& hypos) {
+  // entry: id length, id, number of hypotheses, (score, length, tokens) each
+  writeValue(file_, static_cast<int32_t>(id.size()));
+  file_.write(id.data(), id.size());
+  writeValue(file_, static_cast<int32_t>(hypos.size()));
+  for (int i = 0; i < hypos.size(); i++) {
+    writeValue(file_, hypos.scores[i]);
+    writeValue(file_, static_cast<int32_t>(hypos.length(i)));
+    file_.write(
+        reinterpret_cast<const char*>(hypos.begin(i)),
+        hypos.length(i) * sizeof(int));
+  }
+}
+
+bool HypothesisCache::load() {
+  std::ifstream file(cacheFile_, std::ios::binary);
+  if (!file.is_open()) {
+    return false;
+  }
+
+  bool truncated = false;
+  int32_t idLen, nHypo, hypoLen;
+  float score;
+  std::vector<int> hypo;
+  while (readValue(file, idLen)) {
+    std::string id(idLen, '\0');
+    file.read(&id[0], idLen);
+    truncated = !readValue(file, nHypo);
+    HypothesisBatch hypos;
+    for (int i = 0; !truncated && i < nHypo; i++) {
+      if (!readValue(file, score) || !readValue(file, hypoLen)) {
+        truncated = true;
+        break;
+      }
+      hypo.resize(hypoLen);
+      file.read(reinterpret_cast<char*>(hypo.data()), hypoLen * sizeof(int));
+      hypos.add(hypo.data(), hypo.data() + hypo.size(), score);
+    }
+    if (truncated || !file) {
+      truncated = true;
+      break;
+    }
+    hypos.hypoNums.push_back(nHypo);
+    cache_[id] = std::move(hypos);
+  }
+  LOG(INFO) << "Loaded " << cache_.size() << " cached hypotheses from "
+            << cacheFile_;
+  return truncated;
+}
+
+} // namespace w2l
@@ -0,0 +1,59 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "recipes/models/local_prior_match/src/runtime/HypothesisBatch.h"
+
+namespace w2l {
+
+/**
+ * In-memory and on-disk cache of the filtered beam search hypotheses of
+ * unpaired utterances. Entries are only valid for one key, which identifies
+ * the proposal model and the beam search / filtering settings; changing the
+ * key drops the cache of the previous one.
+ */
+class HypothesisCache {
+ public:
+  /** The `HypothesisCache` class constructor.
+   * @param cacheDir Directory holding the cache files, it must exist.
+   * @param worldRank Rank of this worker, each worker keeps its own file.
+   */
+  HypothesisCache(const std::string& cacheDir, int worldRank);
+
+  // switch to the cache of `key`, reloading it from disk if present
+  void setKey(const std::string& key);
+
+  // look up all utterances of a batch; returns false unless all are cached
+  bool get(const std::vector<std::string>& sampleIds, HypothesisBatch& hypos)
+      const;
+
+  void put(
+      const std::vector<std::string>& sampleIds,
+      const HypothesisBatch& hypos);
+
+ private:
+  std::string cacheDir_;
+  int worldRank_;
+  std::string cacheFile_;
+  // hypotheses of a single utterance per id
+  std::unordered_map<std::string, HypothesisBatch> cache_;
+  std::ofstream file_;
+
+  void writeEntry(const std::string& id, const HypothesisBatch& hypos);
+
+  // returns true if the file ends with a truncated entry
+  bool load();
+};
+
+} // namespace w2l
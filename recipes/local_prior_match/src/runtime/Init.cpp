@@ -48,8 +48,12 @@ std::unordered_map<std::string, std::string> setFlags(int argc, char** argv) {
     auto startEp = epoch == cfg.end() ? 0 : std::stoi(epoch->second);
     auto startIt =
         cfg.find(kIteration) == cfg.end() ? 0 : std::stoi(cfg[kIteration]);
+    // older checkpoints only resume at epoch boundaries
+    auto startEpochIt =
+        cfg.find(kEpochIter) == cfg.end() ? 0 : std::stoi(cfg[kEpochIter]);
 
-    return std::make_pair(startEp, startIt);
+    return std::make_tuple(
+        startEp, startIt, startEpochIt, std::move(cfg[kSchedulerState]));
   };
 
   std::string runStatus = argv[1];
@@ -59,6 +63,8 @@ std::unordered_map<std::string, std::string> setFlags(int argc, char** argv) {
   std::string propPath; // path to proposal model to reload
   int startEpoch = 0;
   int startIter = 0;
+  int startEpochIter = 0;
+  std::string schedulerState;
 
   if (runStatus == kTrainMode) {
     readNewFlags();
@@ -72,7 +78,8 @@ std::unordered_map<std::string, std::string> setFlags(int argc, char** argv) {
     // this assumes that FLAGS_itersave wasn't set
     reloadPath = getRunFile("model_last.bin", runIdx - 1, runPath);
     LOG(INFO) << "reload path is " << reloadPath;
-    std::tie(startEpoch, startIter) = loadOldFlags(reloadPath);
+    std::tie(startEpoch, startIter, startEpochIter, schedulerState) =
+        loadOldFlags(reloadPath);
     readNewFlags();
     propPath = getRunFile("prop.bin", runIdx - 1, runPath);
   } else if (runStatus == kForkMode) {
@@ -104,7 +111,9 @@ std::unordered_map<std::string, std::string> setFlags(int argc, char** argv) {
       {kPropPath, propPath},
       {kRunStatus, runStatus},
       {kStartEpoch, std::to_string(startEpoch)},
-      {kStartIter, std::to_string(startIter)}};
+      {kStartIter, std::to_string(startIter)},
+      {kStartEpochIter, std::to_string(startEpochIter)},
+      {kSchedulerState, schedulerState}};
 
   return config;
 }
@@ -0,0 +1,60 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "recipes/models/local_prior_match/src/runtime/LazyPermutation.h"
+
+#include <glog/logging.h>
+
+namespace w2l {
+
+namespace {
+
+// splitmix64 finalizer
+uint64_t mix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+} // namespace
+
+LazyPermutation::LazyPermutation(int64_t size, uint64_t seed)
+    : size_(size), halfBits_(1) {
+  LOG_IF(FATAL, size_ < 0) << "Invalid permutation size " << size_;
+  // the walk takes fewer than 4 steps on average since 4^halfBits < 4 * size
+  while ((int64_t(1) << (2 * halfBits_)) < size_) {
+    ++halfBits_;
+  }
+  halfMask_ = (uint64_t(1) << halfBits_) - 1;
+  for (auto& key : keys_) {
+    seed = mix(seed);
+    key = seed;
+  }
+}
+
+uint64_t LazyPermutation::encrypt(uint64_t x) const {
+  uint64_t left = x >> halfBits_;
+  uint64_t right = x & halfMask_;
+  for (auto key : keys_) {
+    uint64_t next = left ^ (mix(right ^ key) & halfMask_);
+    left = right;
+    right = next;
+  }
+  return (left << halfBits_) | right;
+}
+
+int64_t LazyPermutation::operator()(int64_t idx) const {
+  uint64_t x = encrypt(idx);
+  while (x >= static_cast<uint64_t>(size_)) {
+    x = encrypt(x);
+  }
+  return x;
+}
+
+} // namespace w2l
@@ -0,0 +1,45 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+namespace w2l {
+
+/**
+ * Pseudo-random permutation of [0, size) evaluated one index at a time. A
+ * seeded Feistel network permutes the smallest power-of-4 range covering
+ * `size`, and indices that land outside [0, size) are walked forward until
+ * they fall back in. Construction is O(1) and needs no O(size) memory, so a
+ * dataset is reshuffled by building a permutation with a new seed.
+ */
+class LazyPermutation {
+ public:
+  explicit LazyPermutation(int64_t size = 0, uint64_t seed = 0);
+
+  // the shuffled position of `idx`, 0 <= idx < size
+  int64_t operator()(int64_t idx) const;
+
+  int64_t size() const {
+    return size_;
+  }
+
+ private:
+  static constexpr int kRounds = 4;
+
+  int64_t size_;
+  int halfBits_;
+  uint64_t halfMask_;
+  std::array<uint64_t, kRounds> keys_;
+
+  uint64_t encrypt(uint64_t x) const;
+};
+
+} // namespace w2l
@@ -18,6 +18,61 @@
 
 namespace w2l {
 
+DeferredStats::DeferredStats() : nIters_(0) {}
+
+void DeferredStats::checkNaN(const af::array& arr, const std::string& msg) {
+  auto hasNaN = af::anyTrue(af::flat(af::isNaN(arr)));
+  auto it = nanFlags_.find(msg);
+  if (it == nanFlags_.end()) {
+    nanFlags_[msg] = hasNaN;
+  } else {
+    it->second = it->second || hasNaN;
+  }
+}
+
+void DeferredStats::add(fl::AverageValueMeter& meter, const af::array& val) {
+  values_.emplace_back(&meter, val);
+}
+
+void DeferredStats::addLoss(
+    const af::array& avgLoss,
+    const af::array& lengths) {
+  auto minLen = af::min(af::flat(lengths));
+  auto maxLen = af::max(af::flat(lengths));
+  if (nIters_ == 0) {
+    lossSum_ = af::flat(avgLoss);
+    minLen_ = minLen;
+    maxLen_ = maxLen;
+  } else {
+    lossSum_ = lossSum_ + af::flat(avgLoss);
+    minLen_ = af::min(minLen_, minLen);
+    maxLen_ = af::max(maxLen_, maxLen);
+  }
+  ++nIters_;
+}
+
+void DeferredStats::flush(const std::string& logPrefix) {
+  for (auto& f : nanFlags_) {
+    if (af::anyTrue<bool>(f.second)) {
+      LOG(FATAL) << f.first << " (within the last " << nIters_
+                 << " iterations)";
+    }
+  }
+  for (auto& v : values_) {
+    v.first->add(v.second);
+  }
+  if (nIters_ > 0) {
+    LOG(INFO) << logPrefix << " Iters=" << nIters_
+              << " AvgLoss=" << lossSum_.scalar<float>() / nIters_
+              << " MinLen=" << minLen_.scalar<int>()
+              << " MaxLen=" << maxLen_.scalar<int>();
+  }
+
+  nanFlags_.clear();
+  values_.clear();
+  nIters_ = 0;
+}
+
 LogHelper::LogHelper(
     int runIdx,
     std::string runPath,
@@ -43,6 +98,10 @@ LogHelper::LogHelper(
   }
 }
 
+LogHelper::~LogHelper() {
+  waitForSave();
+}
+
 void LogHelper::saveConfig(
     const std::unordered_map<std::string, std::string>& config) {
   if (!isMaster_) {
@@ -54,14 +113,16 @@ void LogHelper::saveConfig(
   ar(CEREAL_NVP(config));
 }
 
-void LogHelper::writeHeader(SSLTrainMeters& meters) {
+void LogHelper::writeHeader(
+    SSLTrainMeters& meters,
+    const std::unordered_map<std::string, double>& logFields /* = {} */) {
   if (!isMaster_) {
     return;
   }
 
   std::ofstream perfFile;
   perfFile.open(perfFileName_);
-  auto perfMsg = formatStatus(meters, 0, {}, false, true, "\t", true);
+  auto perfMsg = formatStatus(meters, 0, logFields, false, true, "\t", true);
   appendToLog(perfFile, "# " + perfMsg);
 }
 
@@ -117,6 +178,30 @@ std::string LogHelper::saveModel(
   return outputfile;
 }
 
+void LogHelper::saveModelAsync(
+    const std::string& filename,
+    const std::unordered_map<std::string, std::string>& config,
+    std::shared_ptr<fl::Module> network,
+    std::shared_ptr<SequenceCriterion> criterion) {
+  if (!isMaster_) {
+    return;
+  }
+
+  waitForSave();
+  int device = af::getDevice();
+  auto save = [this, device, filename, config, network, criterion]() {
+    af::setDevice(device);
+    saveModel(filename, config, network, criterion);
+  };
+  asyncSave_ = std::async(std::launch::async, save);
+}
+
+void LogHelper::waitForSave() {
+  if (asyncSave_.valid()) {
+    asyncSave_.get();
+  }
+}
+
 void LogHelper::logAndSaveModel(
     SSLTrainMeters& meters,
     const std::unordered_map<std::string, std::string>& config,
@@ -187,6 +272,13 @@ std::string LogHelper::formatStatus(
 
   insertItem("lr", headerOnly ? "" : format("%4.6lf", logFields.at("lr")));
 
+  // sorted, so that the fields line up with the header
+  std::map<std::string, double> extraFields(logFields.begin(), logFields.end());
+  extraFields.erase("lr");
+  for (auto& f : extraFields) {
+    insertItem(f.first, headerOnly ? "" : format("%.2f", f.second));
+  }
+
   int rt = meters.timer[kRuntime].value();
   insertItem(
       kRuntime,
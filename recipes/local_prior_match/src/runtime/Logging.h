@@ -9,9 +9,12 @@
 #pragma once
 
 #include <fstream>
+#include <future>
 #include <map>
 #include <string>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include <flashlight/flashlight.h>
 
@@ -46,6 +49,7 @@ struct SSLTrainMeters {
                {kBeamTimer, fl::TimeMeter(true)},
                {kBeamFwdTimer, fl::TimeMeter(true)},
                {kLMFwdTimer, fl::TimeMeter(true)},
+               {kLMWaitTimer, fl::TimeMeter(true)},
                {kBwdTimer, fl::TimeMeter(true)},
                {kOptimTimer, fl::TimeMeter(true)}}),
         values({{kLPMLoss, fl::AverageValueMeter()},
@@ -53,16 +57,54 @@ struct SSLTrainMeters {
                 {kNumHypos, fl::AverageValueMeter()},
                 {kLMEnt, fl::AverageValueMeter()},
                 {kLMScore, fl::AverageValueMeter()},
-                {kLen, fl::AverageValueMeter()}}) {}
+                {kLen, fl::AverageValueMeter()},
+                {kPadWaste, fl::AverageValueMeter()},
+                {kHypImbalance, fl::AverageValueMeter()},
+                {kLMImbalance, fl::AverageValueMeter()},
+                {kLMPrefixSkip, fl::AverageValueMeter()}}) {}
+};
+
+/**
+ * Accumulates the per-iteration NaN checks and meter updates on the device.
+ * Nothing is read back to the host until `flush()`, so the training step does
+ * not have to wait for the device to finish.
+ */
+class DeferredStats {
+ public:
+  DeferredStats();
+
+  // `msg` is reported on flush if `arr` has NaN values
+  void checkNaN(const af::array& arr, const std::string& msg);
+
+  // `val` is added to `meter` on flush
+  void add(fl::AverageValueMeter& meter, const af::array& val);
+
+  // per-iteration average loss and target lengths, logged on flush
+  void addLoss(const af::array& avgLoss, const af::array& lengths);
+
+  // check the NaN flags, update the meters and log the loss and target length
+  // statistics accumulated since the last flush
+  void flush(const std::string& logPrefix);
+
+ private:
+  std::map<std::string, af::array> nanFlags_;
+  std::vector<std::pair<fl::AverageValueMeter*, af::array>> values_;
+  af::array lossSum_, minLen_, maxLen_;
+  int64_t nIters_;
 };
 
 class LogHelper {
  public:
   LogHelper(int runIdx, std::string runPath, bool isMaster, bool logOnEpoch);
 
+  ~LogHelper();
+
   void saveConfig(const std::unordered_map<std::string, std::string>& config);
 
-  void writeHeader(SSLTrainMeters& meters);
+  // `logFields` gives the names of the extra fields besides "lr"
+  void writeHeader(
+      SSLTrainMeters& meters,
+      const std::unordered_map<std::string, double>& logFields = {});
 
   void logStatus(
       SSLTrainMeters& mtrs,
@@ -77,6 +119,16 @@ class LogHelper {
       std::shared_ptr<fl::FirstOrderOptimizer> netoptim = nullptr,
       bool workerSave = false);
 
+  // save the model on a background thread; the modules must not be modified
+  // until `waitForSave()` returns
+  void saveModelAsync(
+      const std::string& filename,
+      const std::unordered_map<std::string, std::string>& config,
+      std::shared_ptr<fl::Module> network,
+      std::shared_ptr<SequenceCriterion> criterion);
+
+  void waitForSave();
+
   void logAndSaveModel(
       SSLTrainMeters& meters,
       const std::unordered_map<std::string, std::string>& config,
@@ -101,6 +153,7 @@ class LogHelper {
   std::string logFileName_, perfFileName_;
   // best perf so far on valid datasets
   std::unordered_map<std::string, double> validminerrs_;
+  std::future<void> asyncSave_;
 
   LogHelper() {}
 };
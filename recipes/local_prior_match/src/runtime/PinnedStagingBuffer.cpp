@@ -0,0 +1,80 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "recipes/models/local_prior_match/src/runtime/PinnedStagingBuffer.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace w2l {
+
+PinnedStagingBuffer::~PinnedStagingBuffer() {
+  if (buffer_) {
+    af::freePinned(buffer_);
+  }
+}
+
+void PinnedStagingBuffer::reset() {
+  size_ = 0;
+}
+
+PinnedStagingBuffer::Slot PinnedStagingBuffer::stage(
+    const af::dim4& dims,
+    int val) {
+  size_t n = dims.elements();
+  reserve(size_ + n);
+  std::fill(buffer_ + size_, buffer_ + size_ + n, val);
+  Slot slot{size_, dims};
+  size_ += n;
+  return slot;
+}
+
+PinnedStagingBuffer::Slot PinnedStagingBuffer::stage(
+    const std::vector<int>& vals) {
+  auto slot = stage(af::dim4(vals.size()), 0);
+  std::copy(vals.begin(), vals.end(), data(slot));
+  return slot;
+}
+
+int* PinnedStagingBuffer::data(const Slot& slot) {
+  return buffer_ + slot.offset;
+}
+
+af::array PinnedStagingBuffer::upload() const {
+  if (size_ == 0) {
+    return af::array();
+  }
+  return af::array(af::dim4(size_), buffer_, afHost);
+}
+
+af::array PinnedStagingBuffer::get(
+    const af::array& uploaded,
+    const Slot& slot) {
+  if (slot.dims.elements() == 0) {
+    return af::array();
+  }
+  auto flat = uploaded(
+      af::seq(slot.offset, slot.offset + slot.dims.elements() - 1));
+  return af::moddims(flat, slot.dims);
+}
+
+void PinnedStagingBuffer::reserve(size_t capacity) {
+  if (capacity <= capacity_) {
+    return;
+  }
+  capacity = std::max(capacity, 2 * capacity_);
+  auto buffer = static_cast<int*>(af::pinned(capacity, s32));
+  if (buffer_) {
+    std::memcpy(buffer, buffer_, size_ * sizeof(int));
+    af::freePinned(buffer_);
+  }
+  buffer_ = buffer;
+  capacity_ = capacity;
+}
+
+} // namespace w2l
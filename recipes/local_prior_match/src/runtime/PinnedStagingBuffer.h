@@ -0,0 +1,62 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <vector>
+
+#include <arrayfire.h>
+
+namespace w2l {
+
+/**
+ * Reusable page-locked host buffer for the int arrays (hypothesis targets,
+ * indices) of a training step. Arrays are staged one after another and
+ * uploaded to the device with a single copy, then sliced back out on the
+ * device. The allocation grows to the largest step and is kept afterwards.
+ */
+class PinnedStagingBuffer {
+ public:
+  struct Slot {
+    size_t offset;
+    af::dim4 dims;
+  };
+
+  PinnedStagingBuffer() = default;
+  ~PinnedStagingBuffer();
+
+  PinnedStagingBuffer(const PinnedStagingBuffer&) = delete;
+  PinnedStagingBuffer& operator=(const PinnedStagingBuffer&) = delete;
+
+  // drop all staged arrays, keeping the allocation
+  void reset();
+
+  // stage an array of `dims` filled with `val`
+  Slot stage(const af::dim4& dims, int val);
+
+  // stage a 1D array holding `vals`
+  Slot stage(const std::vector<int>& vals);
+
+  // host pointer to a staged array, valid until the next call to `stage()`
+  int* data(const Slot& slot);
+
+  // copy all staged arrays to the device as one flat s32 array
+  af::array upload() const;
+
+  // the array of `slot` in the result of `upload()`
+  static af::array get(const af::array& uploaded, const Slot& slot);
+
+ private:
+  int* buffer_ = nullptr;
+  size_t capacity_ = 0;
+  size_t size_ = 0;
+
+  void reserve(size_t capacity);
+};
+
+} // namespace w2l
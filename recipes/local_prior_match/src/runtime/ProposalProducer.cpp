@@ -0,0 +1,169 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "recipes/models/local_prior_match/src/runtime/ProposalProducer.h"
+
+#include <glog/logging.h>
+
+#include "common/Defines.h"
+#include "recipes/models/local_prior_match/src/runtime/Defines.h"
+#include "recipes/models/local_prior_match/src/runtime/Utils.h"
+
+namespace w2l {
+
+ProposalProducer::ProposalProducer(
+    DataScheduler* scheduler,
+    std::shared_ptr<fl::Module> propnet,
+    std::shared_ptr<Seq2SeqCriterion> propcrit,
+    int eos,
+    int64_t queueSize)
+    : scheduler_(scheduler),
+      propnet_(propnet),
+      propcrit_(propcrit),
+      eos_(eos),
+      queueSize_(queueSize),
+      version_(0),
+      device_(af::getDevice()),
+      consumedState_(scheduler->getState()),
+      generation_(0),
+      stop_(false) {
+  LOG_IF(FATAL, queueSize <= 0) << "Invalid proposal queue size";
+  worker_ = std::thread(&ProposalProducer::run, this);
+}
+
+ProposalProducer::~ProposalProducer() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  notFull_.notify_all();
+  notEmpty_.notify_all();
+  worker_.join();
+}
+
+ProposalBatch ProposalProducer::get() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  notEmpty_.wait(lock, [this]() { return !queue_.empty() || error_; });
+  if (queue_.empty()) {
+    std::rethrow_exception(error_);
+  }
+  auto batch = std::move(queue_.front());
+  queue_.pop_front();
+  consumedState_ = batch.schedulerState;
+  notFull_.notify_one();
+  return batch;
+}
+
+void ProposalProducer::setProposalModel(
+    std::shared_ptr<fl::Module> propnet,
+    std::shared_ptr<Seq2SeqCriterion> propcrit) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  propnet_ = propnet;
+  propcrit_ = propcrit;
+  ++version_;
+}
+
+std::unique_lock<std::mutex> ProposalProducer::lockProposalModel() {
+  return std::unique_lock<std::mutex>(propMutex_);
+}
+
+int64_t ProposalProducer::version() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return version_;
+}
+
+void ProposalProducer::setSchedule(std::vector<int64_t> newIters) {
+  std::lock_guard<std::mutex> schedulerLock(schedulerMutex_);
+  DataScheduler::State state;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.clear();
+    ++generation_;
+    state = consumedState_;
+  }
+  notFull_.notify_one();
+  // rewind to the first batch that was not handed out
+  scheduler_->setState(state);
+  scheduler_->setSchedule(std::move(newIters));
+}
+
+void ProposalProducer::run() {
+  af::setDevice(device_);
+  try {
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        notFull_.wait(
+            lock, [this]() { return stop_ || queue_.size() < queueSize_; });
+        if (stop_) {
+          return;
+        }
+      }
+      // a dataset is reshuffled in place by the next draw, the queued batches
+      // are handed out first so `setSchedule` can still rewind to them
+      bool reshufflePending;
+      {
+        std::lock_guard<std::mutex> lock(schedulerMutex_);
+        reshufflePending = scheduler_->reshufflePending();
+      }
+      if (reshufflePending) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        notFull_.wait(lock, [this]() { return stop_ || queue_.empty(); });
+        if (stop_) {
+          return;
+        }
+      }
+
+      ProposalBatch batch;
+      int64_t generation;
+      {
+        std::lock_guard<std::mutex> lock(schedulerMutex_);
+        {
+          std::lock_guard<std::mutex> genLock(mutex_);
+          generation = generation_;
+        }
+        batch.sample = scheduler_->get();
+        batch.dataType = scheduler_->getDataType();
+        batch.globalBatchIdx = scheduler_->getGlobalBatchIdx();
+        batch.schedulerState = scheduler_->getState();
+      }
+      batch.propVersion = -1;
+      if (batch.dataType == kUnpairedAudio) {
+        std::lock_guard<std::mutex> propLock(propMutex_);
+        std::shared_ptr<fl::Module> propnet;
+        std::shared_ptr<Seq2SeqCriterion> propcrit;
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          propnet = propnet_;
+          propcrit = propcrit_;
+          batch.propVersion = version_;
+        }
+        auto propoutput = proposalForward(propnet, batch.sample[kInputIdx]);
+        batch.hypos = batchBeamSearch(propoutput, propcrit, eos_);
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        // drawn under a schedule that was replaced meanwhile
+        if (generation != generation_) {
+          continue;
+        }
+        queue_.push_back(std::move(batch));
+      }
+      notEmpty_.notify_one();
+    }
+  } catch (...) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      error_ = std::current_exception();
+    }
+    notEmpty_.notify_all();
+  }
+}
+
+} // namespace w2l
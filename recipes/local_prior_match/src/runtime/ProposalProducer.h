@@ -0,0 +1,105 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <flashlight/flashlight.h>
+
+#include "criterion/criterion.h"
+#include "recipes/models/local_prior_match/src/runtime/DataScheduler.h"
+#include "recipes/models/local_prior_match/src/runtime/HypothesisBatch.h"
+
+namespace w2l {
+
+struct ProposalBatch {
+  std::vector<af::array> sample;
+  int64_t dataType;
+  int64_t globalBatchIdx;
+  // beam search hypotheses, only filled for unpaired audio
+  HypothesisBatch hypos;
+  // version of the proposal model that produced the hypotheses
+  int64_t propVersion;
+  // scheduler state right after this batch was drawn
+  DataScheduler::State schedulerState;
+};
+
+/**
+ * Runs the data scheduler on a worker thread and, for unpaired audio, the
+ * proposal model forward and beam search. Results are handed out in the
+ * exact schedule order through a bounded queue, so the training step only
+ * pays for beam search when the worker falls behind.
+ */
+class ProposalProducer {
+ public:
+  /** The `ProposalProducer` class constructor.
+   * @param scheduler The scheduler to pull samples from. It must not be
+   * accessed by anyone else while the producer is alive, except through
+   * `setSchedule()`.
+   * @param propnet The proposal network.
+   * @param propcrit The proposal criterion.
+   * @param eos Index of the eos token.
+   * @param queueSize Maximum number of batches prepared ahead.
+   */
+  ProposalProducer(
+      DataScheduler* scheduler,
+      std::shared_ptr<fl::Module> propnet,
+      std::shared_ptr<Seq2SeqCriterion> propcrit,
+      int eos,
+      int64_t queueSize);
+
+  ~ProposalProducer();
+
+  // blocks until the next scheduled batch is ready
+  ProposalBatch get();
+
+  // swap in a refreshed proposal model and bump the proposal version
+  void setProposalModel(
+      std::shared_ptr<fl::Module> propnet,
+      std::shared_ptr<Seq2SeqCriterion> propcrit);
+
+  // held while the proposal model is modified; the worker holds it while
+  // running the proposal model
+  std::unique_lock<std::mutex> lockProposalModel();
+
+  int64_t version();
+
+  // batches already queued, or being prepared, are dropped and drawn again
+  // under the new schedule
+  void setSchedule(std::vector<int64_t> newIters);
+
+ private:
+  DataScheduler* scheduler_;
+  std::shared_ptr<fl::Module> propnet_;
+  std::shared_ptr<Seq2SeqCriterion> propcrit_;
+  int eos_;
+  size_t queueSize_;
+  int64_t version_;
+  int device_;
+  // scheduler state after the last batch handed out by `get()`
+  DataScheduler::State consumedState_;
+  // bumped by `setSchedule()`, batches drawn before are dropped
+  int64_t generation_;
+
+  std::deque<ProposalBatch> queue_;
+  bool stop_;
+  std::exception_ptr error_;
+  std::mutex mutex_, propMutex_, schedulerMutex_;
+  std::condition_variable notFull_, notEmpty_;
+  std::thread worker_;
+
+  void run();
+};
+
+} // namespace w2l
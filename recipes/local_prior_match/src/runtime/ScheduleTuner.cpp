@@ -0,0 +1,88 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#include "recipes/models/local_prior_match/src/runtime/ScheduleTuner.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <flashlight/flashlight.h>
+#include <glog/logging.h>
+
+namespace w2l {
+
+ScheduleTuner::ScheduleTuner(double epochSec, double audioRatio)
+    : epochSec_(epochSec), audioRatio_(audioRatio) {
+  LOG_IF(FATAL, audioRatio_ >= 1.0)
+      << "The unpaired audio time ratio must be below 1, got " << audioRatio_;
+}
+
+bool ScheduleTuner::enabled() const {
+  return epochSec_ > 0 || audioRatio_ > 0;
+}
+
+void ScheduleTuner::startStep() {
+  stepStart_ = std::chrono::steady_clock::now();
+}
+
+void ScheduleTuner::stopStep(bool isPaired) {
+  double sec = std::chrono::duration<double>(
+                   std::chrono::steady_clock::now() - stepStart_)
+                   .count();
+  if (isPaired) {
+    pairedSec_ += sec;
+    ++pairedSteps_;
+  } else {
+    audioSec_ += sec;
+    ++audioSteps_;
+  }
+}
+
+std::vector<int64_t> ScheduleTuner::update(
+    const std::vector<int64_t>& curIters) {
+  std::vector<double> stats = {pairedSec_,
+                               static_cast<double>(pairedSteps_),
+                               audioSec_,
+                               static_cast<double>(audioSteps_)};
+  pairedSec_ = audioSec_ = 0;
+  pairedSteps_ = audioSteps_ = 0;
+  if (fl::getWorldSize() > 1) {
+    af::array statsArr(stats.size(), stats.data());
+    fl::allReduce(statsArr);
+    statsArr.host(stats.data());
+  }
+  // keep the previous estimate for a step type not seen this epoch
+  if (stats[1] > 0) {
+    pairedStepSec_ = stats[0] / stats[1];
+  }
+  if (stats[3] > 0) {
+    audioStepSec_ = stats[2] / stats[3];
+  }
+  if (!enabled() || pairedStepSec_ <= 0 || audioStepSec_ <= 0) {
+    return curIters;
+  }
+
+  double pairedIter = curIters[0], audioIter = curIters[1];
+  double curSec = pairedIter * pairedStepSec_ + audioIter * audioStepSec_;
+  double epochSec = epochSec_ > 0 ? epochSec_ : curSec;
+  if (audioRatio_ > 0) {
+    pairedIter = (1.0 - audioRatio_) * epochSec / pairedStepSec_;
+    audioIter = audioRatio_ * epochSec / audioStepSec_;
+  } else {
+    pairedIter *= epochSec / curSec;
+    audioIter *= epochSec / curSec;
+  }
+
+  // a dataset in the schedule is never dropped from it
+  auto toIters = [](double iters, int64_t cur) {
+    return cur > 0 ? std::max<int64_t>(1, std::llround(iters)) : 0;
+  };
+  return {toIters(pairedIter, curIters[0]), toIters(audioIter, curIters[1])};
+}
+
+} // namespace w2l
@@ -0,0 +1,65 @@
+/**
+ * Copyright (c) Facebook, Inc. and its affiliates.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <vector>
+
+namespace w2l {
+
+/**
+ * Picks the number of paired and unpaired audio iterations per epoch from
+ * the measured cost of each kind of step. With an epoch budget the schedule
+ * is rescaled to fit the budget; with an audio ratio the time spent on
+ * unpaired audio is kept at that fraction of the epoch. Step costs are
+ * averaged over all workers, so every worker picks the same schedule.
+ */
+class ScheduleTuner {
+ public:
+  /** The `ScheduleTuner` class constructor.
+   * @param epochSec Target wall-clock seconds per epoch, <= 0 to keep the
+   * current epoch time.
+   * @param audioRatio Target fraction of the epoch time spent on unpaired
+   * audio, <= 0 to keep the current ratio.
+   */
+  ScheduleTuner(double epochSec, double audioRatio);
+
+  bool enabled() const;
+
+  void startStep();
+
+  // the caller syncs the device before stopping a step
+  void stopStep(bool isPaired);
+
+  /**
+   * Collective over all workers. Returns the {paired, audio} iterations for
+   * the next epoch, or `curIters` when a step type was not measured yet.
+   */
+  std::vector<int64_t> update(const std::vector<int64_t>& curIters);
+
+  // average seconds per step from the last update
+  double pairedStepSec() const {
+    return pairedStepSec_;
+  }
+
+  double audioStepSec() const {
+    return audioStepSec_;
+  }
+
+ private:
+  double epochSec_;
+  double audioRatio_;
+
+  std::chrono::time_point<std::chrono::steady_clock> stepStart_;
+  double pairedSec_{0}, audioSec_{0};
+  int64_t pairedSteps_{0}, audioSteps_{0};
+  double pairedStepSec_{0}, audioStepSec_{0};
+};
+
+} // namespace w2l
@@ -5,17 +5,100 @@
  * This source code is licensed under the BSD-style license found in the
  * LICENSE file in the root directory of this source tree.
  */
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <limits>
+#include <numeric>
+#include <sstream>
+
 #include <arrayfire.h>
+#include <cereal/archives/binary.hpp>
+#include <glog/logging.h>
 
 #include "recipes/models/local_prior_match/src/runtime/Utils.h"
 
 #include "common/Defines.h"
+#include "common/FlashlightUtils.h"
 #include "common/Transforms.h"
 #include "common/Utils.h"
 #include "recipes/models/local_prior_match/src/runtime/Defines.h"
 
 namespace w2l {
 
+namespace {
+
+struct BeamHypo {
+  int uttIdx;
+  float score;
+  std::vector<int> path;
+};
+
+// gather the decoder states of the given hypotheses along the batch dimension
+Seq2SeqState selectStates(const Seq2SeqState& state, const af::array& idx) {
+  int nAttnRound = state.hidden.size();
+  Seq2SeqState newState(nAttnRound);
+  newState.step = state.step;
+  newState.peakAttnPos = state.peakAttnPos;
+  newState.isValid = state.isValid;
+  newState.alpha = state.alpha(af::span, af::span, idx);
+  if (!state.summary.isempty()) {
+    newState.summary = state.summary(af::span, af::span, idx);
+  }
+  for (int i = 0; i < nAttnRound; i++) {
+    newState.hidden[i] = state.hidden[i](af::span, idx);
+  }
+  return newState;
+}
+
+// L x B dims of the padded target matrix of the hypotheses in `range`, L is
+// at least `padLen`
+af::dim4 targetDims(
+    const HypothesisBatch& hypos,
+    const std::pair<int, int>& range,
+    int padLen) {
+  int maxTgtSize = padLen;
+  for (int i = range.first; i < range.second; i++) {
+    if (hypos.length(i) == 0) {
+      throw std::runtime_error("Target has zero length.");
+    }
+    maxTgtSize = std::max(maxTgtSize, hypos.length(i));
+  }
+  return af::dim4(maxTgtSize, range.second - range.first);
+}
+
+// copy the hypotheses in `range` into the columns of a padded L x B matrix
+// (col major) at `dst`
+void copyTarget(
+    const HypothesisBatch& hypos,
+    const std::pair<int, int>& range,
+    int maxTgtSize,
+    int* dst) {
+  for (int i = range.first; i < range.second; i++) {
+    std::copy(
+        hypos.begin(i), hypos.end(i), dst + maxTgtSize * (i - range.first));
+  }
+}
+
+// true if `module` or one of its submodules keeps state that is not a
+// parameter, e.g. the running mean and variance of BatchNorm
+bool hasNonParamState(const std::shared_ptr<fl::Module>& module) {
+  if (std::dynamic_pointer_cast<fl::BatchNorm>(module)) {
+    return true;
+  }
+  auto container = std::dynamic_pointer_cast<fl::Container>(module);
+  if (container) {
+    for (const auto& m : container->modules()) {
+      if (hasNonParamState(m)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+} // namespace
+
 std::vector<int> genTokenDictIndexMap(
     const Dictionary& dict1,
     const Dictionary& dict2) {
@@ -36,112 +119,448 @@ af::array getTargetLength(af::array& target, int eosIdx) {
   return af::sum(target != eosIdx, 0).as(af::dtype::s32) + 1;
 }
 
-std::pair<std::vector<std::vector<int>>, std::vector<int>> batchBeamSearch(
+HypothesisBatch batchBeamSearch(
     const fl::Variable& output,
     const std::shared_ptr<Seq2SeqCriterion>& criterion,
     int eos) {
-  std::vector<std::vector<int>> paths;
-  std::vector<int> hypoNums;
-  for (int b = 0; b < output.dims(2); b++) {
-    std::vector<Seq2SeqCriterion::CandidateHypo> initBeam;
-    initBeam.emplace_back(Seq2SeqCriterion::CandidateHypo{});
-    auto hypos = criterion->beamSearch(
-        output.array()(af::span, af::span, b),
-        initBeam,
-        FLAGS_lpmBeamsz,
-        FLAGS_maxdecoderoutputlen);
+  int batchSz = output.dims(2);
+  int beamSize = FLAGS_lpmBeamsz;
+  auto encoderOutput = fl::Variable(output.array(), false);
+
+  // all live hypotheses of all utterances are decoded together; `beam` is
+  // kept grouped by utterance and `state` is aligned with it along the batch
+  std::vector<BeamHypo> beam(batchSz);
+  for (int b = 0; b < batchSz; b++) {
+    beam[b].uttIdx = b;
+  }
+  std::vector<std::vector<BeamHypo>> complete(batchSz);
+  std::vector<std::vector<BeamHypo>> unfinished(batchSz);
+  Seq2SeqState state(FLAGS_decoderattnround);
+
+  for (int l = 0; l < FLAGS_maxdecoderoutputlen && !beam.empty(); l++) {
+    int nHypo = beam.size();
+    std::vector<int> uttIdx(nHypo);
+    std::vector<int> prevTokens(nHypo);
+    std::vector<float> prevScores(nHypo);
+    for (int i = 0; i < nHypo; i++) {
+      uttIdx[i] = beam[i].uttIdx;
+      prevTokens[i] = beam[i].path.empty() ? -1 : beam[i].path.back();
+      prevScores[i] = beam[i].score;
+    }
+
+    fl::Variable prevY, xEncoded;
+    if (l == 0) {
+      xEncoded = encoderOutput;
+    } else {
+      prevY = fl::Variable(af::array(1, nHypo, prevTokens.data()), false);
+      xEncoded =
+          encoderOutput(af::span, af::span, af::array(nHypo, uttIdx.data()));
+    }
+
+    fl::Variable ox;
+    Seq2SeqState newState;
+    std::tie(ox, newState) = criterion->decodeStep(xEncoded, prevY, state);
+    ox = fl::reorder(fl::logSoftmax(ox, 0), 0, 2, 1); // C x nHypo
+    int nClass = ox.dims(0);
+
+    auto scoreArr = af::tile(af::array(1, nHypo, prevScores.data()), nClass);
+    auto scoreVec = afToVector<float>(af::flat(scoreArr + ox.array()));
 
+    std::vector<BeamHypo> newBeam;
+    std::vector<int> parentIdx;
+    int begin = 0;
+    while (begin < nHypo) {
+      int u = uttIdx[begin];
+      int end = begin;
+      while (end < nHypo && uttIdx[end] == u) {
+        ++end;
+      }
+
+      // top candidates among the hypotheses of utterance u
+      std::vector<int> indices((end - begin) * nClass);
+      std::iota(indices.begin(), indices.end(), begin * nClass);
+      int nCand = std::min(2 * beamSize, static_cast<int>(indices.size()));
+      std::partial_sort(
+          indices.begin(),
+          indices.begin() + nCand,
+          indices.end(),
+          [&scoreVec](int i1, int i2) { return scoreVec[i1] > scoreVec[i2]; });
+
+      std::vector<BeamHypo> uttBeam;
+      std::vector<int> uttParentIdx;
+      for (int j = 0; j < nCand && uttBeam.size() < beamSize; j++) {
+        int hypIdx = indices[j] / nClass;
+        int clsIdx = indices[j] % nClass;
+        if (clsIdx == eos) {
+          if (j < beamSize) {
+            complete[u].push_back(
+                BeamHypo{u, scoreVec[indices[j]], beam[hypIdx].path});
+          }
+          continue;
+        }
+        BeamHypo hypo{u, scoreVec[indices[j]], beam[hypIdx].path};
+        hypo.path.push_back(clsIdx);
+        uttBeam.push_back(std::move(hypo));
+        uttParentIdx.push_back(hypIdx);
+      }
+
+      bool finished = uttBeam.empty();
+      if (complete[u].size() >= beamSize) {
+        std::partial_sort(
+            complete[u].begin(),
+            complete[u].begin() + beamSize,
+            complete[u].end(),
+            [](const BeamHypo& lhs, const BeamHypo& rhs) {
+              return lhs.score > rhs.score;
+            });
+        complete[u].resize(beamSize);
+        // no future hypothesis can replace the completed ones
+        finished = finished || complete[u].back().score > uttBeam[0].score;
+      }
+
+      if (finished) {
+        unfinished[u] = std::move(uttBeam);
+      } else {
+        std::move(uttBeam.begin(), uttBeam.end(), std::back_inserter(newBeam));
+        parentIdx.insert(
+            parentIdx.end(), uttParentIdx.begin(), uttParentIdx.end());
+        unfinished[u].clear();
+      }
+      begin = end;
+    }
+
+    beam = std::move(newBeam);
+    if (!beam.empty()) {
+      state = selectStates(
+          newState, af::array(parentIdx.size(), parentIdx.data()));
+    }
+    for (auto& hypo : beam) {
+      unfinished[hypo.uttIdx].push_back(hypo);
+    }
+  }
+
+  HypothesisBatch result;
+  for (int b = 0; b < batchSz; b++) {
+    auto& hypos = complete[b].empty() ? unfinished[b] : complete[b];
     for (auto& hypo : hypos) {
       hypo.path.push_back(eos);
-      paths.push_back(hypo.path);
+      result.add(
+          hypo.path.data(), hypo.path.data() + hypo.path.size(), hypo.score);
     }
-    hypoNums.push_back(hypos.size());
+    result.hypoNums.push_back(hypos.size());
   }
 
-  return std::make_pair(paths, hypoNums);
+  return result;
 }
 
-std::pair<std::vector<std::vector<int>>, std::vector<int>> filterBeamByLength(
-    const std::vector<std::vector<int>>& paths,
-    const std::vector<int>& hypoNums,
+void filterBeamByLength(
+    HypothesisBatch& hypos,
     const std::vector<int>& refLengths) {
-  if (hypoNums.size() != refLengths.size()) {
+  if (hypos.hypoNums.size() != refLengths.size()) {
     throw std::runtime_error(
-        "size of hypoNums (" + std::to_string(hypoNums.size()) +
+        "size of hypoNums (" + std::to_string(hypos.hypoNums.size()) +
         ") and refLengths (" + std::to_string(refLengths.size()) +
         ") do not match");
   }
 
   if (FLAGS_hyplenratiolb < 0 && FLAGS_hyplenratioub < 0) {
-    return std::make_pair(paths, hypoNums);
+    return;
   }
 
   int offset = 0;
-  std::vector<std::vector<int>> newPaths;
-  std::vector<int> newHypoNums;
-  for (int b = 0; b < hypoNums.size(); b++) {
-    int newHypoNum = 0;
+  std::vector<bool> keep(hypos.size());
+  for (int b = 0; b < hypos.hypoNums.size(); b++) {
     int lb = std::floor(FLAGS_hyplenratiolb * refLengths[b]);
     int ub = std::ceil(FLAGS_hyplenratioub * refLengths[b]);
 
-    for (int i = 0; i < hypoNums[b]; i++) {
+    for (int i = 0; i < hypos.hypoNums[b]; i++) {
       int curIdx = offset + i;
-      auto curLen = paths[curIdx].size();
+      auto curLen = hypos.length(curIdx);
       // also remove length=1 (empty hypotheses)
-      if (curLen <= 1 || (ub > 0 && curLen > ub) || curLen < lb) {
-        continue;
-      }
-      newPaths.push_back(paths[curIdx]);
-      newHypoNum += 1;
+      keep[curIdx] = !(curLen <= 1 || (ub > 0 && curLen > ub) || curLen < lb);
     }
-    offset += hypoNums[b];
-    newHypoNums.push_back(newHypoNum);
+    offset += hypos.hypoNums[b];
+  }
+  hypos.filter(keep);
+}
+
+std::vector<std::pair<int, int>> splitByTokenBudget(
+    const HypothesisBatch& hypos,
+    int64_t tokenBudget) {
+  int maxLen = 1;
+  for (int i = 0; i < hypos.size(); i++) {
+    maxLen = std::max(maxLen, hypos.length(i));
+  }
+  int64_t rangeSize = std::max<int64_t>(tokenBudget / maxLen, 1);
+  std::vector<std::pair<int, int>> ranges;
+  for (int64_t begin = 0; begin < hypos.size(); begin += rangeSize) {
+    ranges.emplace_back(
+        begin, std::min<int64_t>(begin + rangeSize, hypos.size()));
   }
+  return ranges;
+}
 
-  return std::make_pair(newPaths, newHypoNums);
+double paddingWaste(
+    const HypothesisBatch& hypos,
+    const std::vector<std::pair<int, int>>& ranges) {
+  int64_t numTokens = 0, numPadded = 0;
+  for (const auto& r : ranges) {
+    int maxLen = 0;
+    for (int i = r.first; i < r.second; i++) {
+      numTokens += hypos.length(i);
+      maxLen = std::max(maxLen, hypos.length(i));
+    }
+    numPadded += static_cast<int64_t>(maxLen) * (r.second - r.first);
+  }
+  if (numPadded == 0) {
+    return 0.0;
+  }
+  return 1.0 - static_cast<double>(numTokens) / numPadded;
 }
 
-af::array batchTarget(
-    const std::vector<std::vector<int>>& tgt,
-    const int& padVal) {
-  std::vector<int> vecTgt;
-  af::dim4 vecTgtDims;
-  int batchSz = tgt.size();
-  size_t maxTgtSize = 0;
+af::array balancedLMForward(
+    const std::shared_ptr<fl::Module>& lm,
+    const HypothesisBatch& hypos,
+    int eos,
+    double& imbalance,
+    double& lmImbalance) {
+  int worldSize = fl::getWorldSize();
+  int worldRank = fl::getWorldRank();
+  int maxLen = 0;
+  for (int i = 0; i < hypos.size(); i++) {
+    maxLen = std::max(maxLen, hypos.length(i));
+  }
 
-  if (batchSz == 0) {
+  // number of hypotheses and longest hypothesis of every rank
+  std::vector<float> info(2 * worldSize, 0);
+  info[worldRank] = hypos.size();
+  info[worldSize + worldRank] = maxLen;
+  if (worldSize > 1) {
+    auto infoArr = af::array(info.size(), info.data());
+    fl::allReduce(infoArr);
+    info = afToVector<float>(infoArr);
+  }
+  std::vector<int> offsets(worldSize + 1, 0);
+  int globalMaxLen = 0, maxCount = 0;
+  for (int r = 0; r < worldSize; r++) {
+    int count = info[r];
+    offsets[r + 1] = offsets[r] + count;
+    maxCount = std::max(maxCount, count);
+    globalMaxLen =
+        std::max(globalMaxLen, static_cast<int>(info[worldSize + r]));
+  }
+  int total = offsets[worldSize];
+  if (total == 0) {
+    imbalance = lmImbalance = 1.0;
     return af::array();
   }
+  double meanCount = static_cast<double>(total) / worldSize;
+  imbalance = maxCount / meanCount;
+  lmImbalance = ((total + worldSize - 1) / worldSize) / meanCount;
 
-  for (const auto& t : tgt) {
-    if (t.size() == 0) {
-      throw std::runtime_error("Target has zero length.");
+  // targets of all ranks, each rank fills its own columns; token indices
+  // are exchanged as f32, which holds them exactly
+  std::vector<float> tokens(globalMaxLen * total, 0);
+  for (int i = 0; i < hypos.size(); i++) {
+    auto col = tokens.begin() + globalMaxLen * (offsets[worldRank] + i);
+    std::fill(col, col + globalMaxLen, eos);
+    std::copy(hypos.begin(i), hypos.end(i), col);
+  }
+  auto globalTargets = af::array(globalMaxLen, total, tokens.data());
+  if (worldSize > 1) {
+    fl::allReduce(globalTargets);
+  }
+
+  // score an equal slice of all hypotheses
+  int begin = static_cast<int64_t>(total) * worldRank / worldSize;
+  int end = static_cast<int64_t>(total) * (worldRank + 1) / worldSize;
+  auto globalScores = af::constant(0, total, f32);
+  if (end > begin) {
+    af::array targets =
+        globalTargets(af::span, af::seq(begin, end - 1)).as(s32);
+    auto lengths = getTargetLength(targets, eos);
+    auto scores =
+        lm->forward({fl::noGrad(targets), fl::noGrad(lengths)}).front();
+    globalScores(af::seq(begin, end - 1)) = scores.array();
+  }
+  if (worldSize > 1) {
+    fl::allReduce(globalScores);
+  }
+
+  if (hypos.size() == 0) {
+    return af::array();
+  }
+  return globalScores(af::seq(offsets[worldRank], offsets[worldRank + 1] - 1));
+}
+
+PinnedStagingBuffer::Slot stageTarget(
+    const HypothesisBatch& hypos,
+    const std::pair<int, int>& range,
+    const int& padVal,
+    PinnedStagingBuffer& staging,
+    int padLen /* = 0 */) {
+  auto slot = staging.stage(targetDims(hypos, range, padLen), padVal);
+  copyTarget(hypos, range, slot.dims[0], staging.data(slot));
+  return slot;
+}
+
+bool copyParams(
+    const std::shared_ptr<fl::Module>& src,
+    const std::shared_ptr<fl::Module>& dst) {
+  auto srcParams = src->params();
+  auto dstParams = dst->params();
+  if (srcParams.size() != dstParams.size()) {
+    return false;
+  }
+  for (int i = 0; i < srcParams.size(); i++) {
+    if (srcParams[i].dims() != dstParams[i].dims()) {
+      return false;
+    }
+  }
+  for (int i = 0; i < srcParams.size(); i++) {
+    auto type = dstParams[i].type();
+    const auto& arr = srcParams[i].array();
+    dst->setParams(
+        fl::Variable(
+            arr.type() == type ? arr.copy() : arr.as(type),
+            dstParams[i].isCalcGrad()),
+        i);
+  }
+  return true;
+}
+
+void refreshProposalModel(
+    const std::shared_ptr<fl::Module>& network,
+    const std::shared_ptr<Seq2SeqCriterion>& criterion,
+    std::shared_ptr<fl::Module>& propnet,
+    std::shared_ptr<Seq2SeqCriterion>& propcrit) {
+  // The criterion carries configuration that is neither a parameter nor
+  // part of its prettyString (e.g. the attention window and whether it is
+  // used in training), so it is always cloned; it is small next to the
+  // network.
+  std::shared_ptr<SequenceCriterion> baseCrit = criterion;
+  std::stringstream critStream;
+  {
+    cereal::BinaryOutputArchive ar(critStream);
+    ar(baseCrit);
+  }
+  {
+    cereal::BinaryInputArchive ar(critStream);
+    ar(baseCrit);
+  }
+  propcrit = std::dynamic_pointer_cast<Seq2SeqCriterion>(baseCrit);
+
+  // the network is updated in place if it has the same architecture and
+  // no state besides its parameters
+  if (network->prettyString() == propnet->prettyString() &&
+      !hasNonParamState(network) && copyParams(network, propnet)) {
+    return;
+  }
+
+  LOG(INFO) << "Proposal network not updatable in place, cloning network";
+  std::stringstream netStream;
+  {
+    cereal::BinaryOutputArchive ar(netStream);
+    ar(network);
+  }
+  {
+    cereal::BinaryInputArchive ar(netStream);
+    ar(propnet);
+  }
+}
+
+double scaleAndClipGradNorm(
+    const std::vector<fl::Variable>& params,
+    double scale,
+    double maxNorm) {
+  double gradNorm = 0.0;
+  double factor = scale;
+  if (maxNorm > 0) {
+    af::array sqNorm = af::constant(0.0, 1);
+    for (const auto& p : params) {
+      if (!p.isGradAvailable()) {
+        continue;
+      }
+      const auto& grad = p.grad().array();
+      sqNorm += af::sum(af::flat(grad * grad));
+    }
+    gradNorm = std::sqrt(sqNorm.scalar<float>()) * scale;
+    double clipScale = maxNorm / (gradNorm + 1e-6);
+    if (clipScale < 1.0) {
+      factor *= clipScale;
+    }
+  }
+
+  if (factor != 1.0) {
+    for (const auto& p : params) {
+      if (!p.isGradAvailable()) {
+        continue;
+      }
+      auto& grad = p.grad().array();
+      grad = grad * factor;
     }
-    maxTgtSize = std::max(maxTgtSize, t.size());
   }
-  // L X BATCHSZ (Col Major)
-  vecTgt.resize(maxTgtSize * batchSz, padVal);
-  vecTgtDims = af::dim4(maxTgtSize, batchSz);
+  return gradNorm;
+}
+
+void convertParams(const std::shared_ptr<fl::Module>& module, af::dtype type) {
+  auto params = module->params();
+  for (int i = 0; i < params.size(); i++) {
+    if (params[i].type() != type) {
+      module->setParams(
+          fl::Variable(params[i].array().as(type), params[i].isCalcGrad()),
+          i);
+    }
+  }
+}
+
+fl::Variable proposalForward(
+    const std::shared_ptr<fl::Module>& propnet,
+    const af::array& input) {
+  auto type = propnet->param(0).type();
+  auto output = propnet->forward({fl::input(input.as(type))}).front();
+  return output.type() == f32 ? output : output.as(f32);
+}
 
-  for (size_t i = 0; i < batchSz; ++i) {
-    std::copy(tgt[i].begin(), tgt[i].end(), vecTgt.begin() + maxTgtSize * i);
+double timeIt(const std::function<void()>& fn, int nRuns /* = 3 */) {
+  fn();
+  af::sync();
+  fl::TimeMeter meter;
+  meter.resume();
+  for (int i = 0; i < nRuns; i++) {
+    fn();
   }
-  return af::array(vecTgtDims, vecTgt.data());
+  af::sync();
+  meter.stop();
+  return meter.value() / nRuns;
 }
 
 fl::Variable batchEncoderOutput(
     const std::vector<int>& hypoNums,
     const fl::Variable& encoderOutput) {
-  // tile and batch encoder outputs
-  std::vector<fl::Variable> tiledEncoderOutputVec;
+  // hypothesis -> utterance index map; the encoder output of every utterance
+  // is gathered once per hypothesis in a single lookup
+  std::vector<int> uttIdxVec;
   for (int i = 0; i < hypoNums.size(); i++) {
-    if (hypoNums[i] > 0) {
-      auto curOutpt = encoderOutput(af::span, af::span, i);
-      auto curTiledOutput = fl::tile(curOutpt, af::dim4(1, 1, hypoNums[i]));
-      tiledEncoderOutputVec.emplace_back(curTiledOutput);
-    }
+    uttIdxVec.insert(uttIdxVec.end(), hypoNums[i], i);
   }
-  return concatenate(tiledEncoderOutputVec, 2);
+  auto uttIdx = af::array(uttIdxVec.size(), uttIdxVec.data());
+  auto result = af::lookup(encoderOutput.array(), uttIdx, 2);
+
+  // hypotheses of an utterance are contiguous, so the gradient of each
+  // utterance is a segmented sum over its hypotheses
+  auto inDims = encoderOutput.dims();
+  auto inType = encoderOutput.type();
+  auto gradFunc = [uttIdx, inDims, inType](
+                      std::vector<fl::Variable>& inputs,
+                      const fl::Variable& gradOutput) {
+    af::array keys, vals;
+    af::sumByKey(keys, vals, uttIdx, gradOutput.array(), 2);
+    auto grad = af::constant(0, inDims, inType);
+    grad(af::span, af::span, keys) = vals;
+    inputs[0].addGrad(fl::Variable(grad, false));
+  };
+  return fl::Variable(result, {encoderOutput.withoutData()}, gradFunc);
 }
 
 // maybe renormalize and/or change to linear scale
@@ -154,30 +573,53 @@ fl::Variable adjustProb(
     return logprob;
   }
 
-  std::vector<fl::Variable> outputVec;
-  int offset = 0;
+  int total = 0, maxHypoNum = 0, numSegments = 0;
   for (auto& hypoNum : hypoNums) {
     if (hypoNum > 0) {
-      auto logprobSlice = logprob(af::seq(offset, offset + hypoNum - 1));
-      if (renormalize && linear) {
-        outputVec.emplace_back(fl::softmax(logprobSlice, 0));
-      } else if (renormalize && !linear) {
-        outputVec.emplace_back(fl::logSoftmax(logprobSlice, 0));
-      } else if (!renormalize && linear) {
-        outputVec.emplace_back(fl::exp(logprobSlice));
-      } else {
-        throw std::runtime_error(
-            "Something is really wrong. Should never arrive here.");
-      }
-      offset += hypoNum;
+      total += hypoNum;
+      maxHypoNum = std::max(maxHypoNum, hypoNum);
+      ++numSegments;
     }
   }
-  if (offset != logprob.dims()[0]) {
+  if (total != logprob.dims()[0]) {
     throw std::runtime_error(
-        "Total number of hypos inconsistent : " + std::to_string(offset) +
+        "Total number of hypos inconsistent : " + std::to_string(total) +
         " vs " + std::to_string(logprob.dims()[0]));
   }
-  return concatenate(outputVec, 0);
+  if (!renormalize) {
+    return fl::exp(logprob);
+  }
+
+  // Lay the hypotheses of each utterance out as a column of a
+  // [maxHypoNum, numSegments] matrix padded with -inf, so the softmax of all
+  // utterances runs as a single op. `padIdx` gathers the matrix from
+  // `logprob` (index `total` is the padding), `flatIdx` gathers the result
+  // back in the original order.
+  std::vector<int> padIdx(maxHypoNum * numSegments, total);
+  std::vector<int> flatIdx;
+  flatIdx.reserve(total);
+  int offset = 0, col = 0;
+  for (auto& hypoNum : hypoNums) {
+    if (hypoNum > 0) {
+      for (int i = 0; i < hypoNum; i++) {
+        padIdx[col * maxHypoNum + i] = offset + i;
+        flatIdx.push_back(col * maxHypoNum + i);
+      }
+      offset += hypoNum;
+      ++col;
+    }
+  }
+  auto padVal = fl::Variable(
+      af::constant(-std::numeric_limits<float>::infinity(), 1, logprob.type()),
+      false);
+  auto padded = fl::concatenate({fl::moddims(logprob, {total}), padVal}, 0);
+  padded = fl::moddims(
+      padded(af::array(padIdx.size(), padIdx.data())),
+      {maxHypoNum, numSegments});
+  auto output = linear ? fl::softmax(padded, 0) : fl::logSoftmax(padded, 0);
+  output = fl::moddims(output, {maxHypoNum * numSegments});
+  return fl::moddims(
+      output(af::array(flatIdx.size(), flatIdx.data())), logprob.dims());
 }
 
 fl::Variable entropy(const fl::Variable& p) {
@@ -8,6 +8,7 @@
 
 #pragma once
 
+#include <functional>
 #include <string>
 #include <utility>
 
@@ -15,6 +16,8 @@
 
 #include "criterion/criterion.h"
 #include "libraries/common/Dictionary.h"
+#include "recipes/models/local_prior_match/src/runtime/HypothesisBatch.h"
+#include "recipes/models/local_prior_match/src/runtime/PinnedStagingBuffer.h"
 
 namespace w2l {
 /**
@@ -29,16 +32,43 @@ std::vector<int> genTokenDictIndexMap(
 
 af::array getTargetLength(af::array& target, int eosIdx);
 
-std::pair<std::vector<std::vector<int>>, std::vector<int>> batchBeamSearch(
+/**
+ * Beam search over all utterances of `output` (H x T x B) at once. The live
+ * hypotheses of every utterance are advanced with a single decoder step;
+ * utterances leave the batch when their beam is complete. Returns the
+ * eos-terminated hypotheses grouped by utterance.
+ */
+HypothesisBatch batchBeamSearch(
     const fl::Variable& output,
     const std::shared_ptr<Seq2SeqCriterion>& criterion,
     int eos);
 
-std::pair<std::vector<std::vector<int>>, std::vector<int>> filterBeamByLength(
-    const std::vector<std::vector<int>>& paths,
-    const std::vector<int>& hypoNums,
+// drop hypotheses of bad length relative to `refLengths`, in place
+void filterBeamByLength(
+    HypothesisBatch& hypos,
     const std::vector<int>& refLengths);
 
+/**
+ * Split `hypos` into consecutive ranges [begin, end) such that each range,
+ * padded to the longest hypothesis of all of `hypos`, holds at most
+ * `tokenBudget` tokens. Every range holds at least one hypothesis.
+ */
+std::vector<std::pair<int, int>> splitByTokenBudget(
+    const HypothesisBatch& hypos,
+    int64_t tokenBudget);
+
+/**
+ * Fraction of padding tokens when each range of `hypos` is batched with
+ * `stageTarget`, i.e. padded to the longest hypothesis of the range.
+ */
+double paddingWaste(
+    const HypothesisBatch& hypos,
+    const std::vector<std::pair<int, int>>& ranges);
+
+/**
+ * (Log-)softmax or exp of `logprob` within each group of `hypoNums`
+ * consecutive hypotheses. All groups are normalized by a single op.
+ */
 fl::Variable adjustProb(
     const fl::Variable& logprob,
     const std::vector<int>& hypoNums,
@@ -47,10 +77,88 @@ fl::Variable adjustProb(
 
 fl::Variable entropy(const fl::Variable& logprob);
 
-af::array batchTarget(
-    const std::vector<std::vector<int>>& tgt,
-    const int& padVal);
+/**
+ * Score the hypotheses of this rank with `lm`, sharing the LM work evenly
+ * between all ranks: the hypotheses of all ranks are gathered, each rank
+ * scores an equal slice, and the scores are sent back to the rank that owns
+ * them. This is collective, every rank has to call it, also with no
+ * hypotheses. Returns the LM output for the hypotheses of this rank.
+ * @param imbalance Set to the ratio of the largest to the mean number of
+ * hypotheses per rank.
+ * @param lmImbalance Same ratio for the number of hypotheses each rank
+ * scores.
+ */
+af::array balancedLMForward(
+    const std::shared_ptr<fl::Module>& lm,
+    const HypothesisBatch& hypos,
+    int eos,
+    double& imbalance,
+    double& lmImbalance);
+
+/**
+ * Write the L x B target matrix of the hypotheses [range.first,
+ * range.second) of `hypos`, padded with `padVal`, into `staging`, so it can
+ * be uploaded together with the other arrays of the step. L is the longest
+ * hypothesis of the range, or `padLen` if that is larger.
+ */
+PinnedStagingBuffer::Slot stageTarget(
+    const HypothesisBatch& hypos,
+    const std::pair<int, int>& range,
+    const int& padVal,
+    PinnedStagingBuffer& staging,
+    int padLen = 0);
 
+/**
+ * Copy the parameters of `src` into `dst` without leaving the device, cast to
+ * the type of the parameters of `dst`. Returns false, leaving `dst`
+ * untouched, if the two modules do not have the same parameter layout.
+ */
+bool copyParams(
+    const std::shared_ptr<fl::Module>& src,
+    const std::shared_ptr<fl::Module>& dst);
+
+/**
+ * Make the proposal model a copy of the current network and criterion. The
+ * criterion is replaced by an in-memory clone. The network parameters are
+ * copied in place when both networks have the same prettyString and no
+ * state besides their parameters (e.g. no BatchNorm running statistics);
+ * otherwise the network is cloned as well.
+ */
+void refreshProposalModel(
+    const std::shared_ptr<fl::Module>& network,
+    const std::shared_ptr<Seq2SeqCriterion>& criterion,
+    std::shared_ptr<fl::Module>& propnet,
+    std::shared_ptr<Seq2SeqCriterion>& propcrit);
+
+/**
+ * Multiply the gradients of `params` by `scale` and clip their total norm to
+ * `maxNorm` (if > 0) with a single multiplication per gradient. The norm is
+ * accumulated on the device and read back once. Returns the norm of the
+ * scaled gradients before clipping.
+ */
+double scaleAndClipGradNorm(
+    const std::vector<fl::Variable>& params,
+    double scale,
+    double maxNorm);
+
+// cast the parameters of `module` to `type`
+void convertParams(const std::shared_ptr<fl::Module>& module, af::dtype type);
+
+/**
+ * Run the proposal network on `input` in the precision of its parameters and
+ * return the output in fp32.
+ */
+fl::Variable proposalForward(
+    const std::shared_ptr<fl::Module>& propnet,
+    const af::array& input);
+
+// average wall-clock time in seconds of `fn`, after one warm-up run
+double timeIt(const std::function<void()>& fn, int nRuns = 3);
+
+/**
+ * Batch the encoder output [H, T, B] of each utterance once per hypothesis,
+ * i.e. `hypoNums[i]` times for utterance i, into [H, T, sum(hypoNums)].
+ */
 fl::Variable batchEncoderOutput(
     const std::vector<int>& hypoNums,
     const fl::Variable& encoderOutput);
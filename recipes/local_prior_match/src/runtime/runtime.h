@@ -11,6 +11,12 @@
 #include "recipes/models/local_prior_match/src/runtime/DataScheduler.h"
 #include "recipes/models/local_prior_match/src/runtime/Defines.h"
 #include "recipes/models/local_prior_match/src/runtime/Eval.h"
+#include "recipes/models/local_prior_match/src/runtime/HypothesisBatch.h"
+#include "recipes/models/local_prior_match/src/runtime/HypothesisCache.h"
 #include "recipes/models/local_prior_match/src/runtime/Init.h"
+#include "recipes/models/local_prior_match/src/runtime/LazyPermutation.h"
 #include "recipes/models/local_prior_match/src/runtime/Logging.h"
+#include "recipes/models/local_prior_match/src/runtime/PinnedStagingBuffer.h"
+#include "recipes/models/local_prior_match/src/runtime/ProposalProducer.h"
+#include "recipes/models/local_prior_match/src/runtime/ScheduleTuner.h"
 #include "recipes/models/local_prior_match/src/runtime/Utils.h"